@@ -0,0 +1,85 @@
+#!/bin/bash
+# Bench dos tres analisadores sobre CSVs sinteticos gerados por gerar_dados.
+# Compila as variantes, gera um arquivo por tamanho (sempre com a mesma
+# semente) e roda cada combinacao de variante, modo, tamanho e numero de
+# threads. O resultado e um CSV separado por ';', uma linha por execucao:
+#
+#   variante;modo;linhas;threads;repeticao;total;leitura;agregacao;fusao;escrita
+#
+# Os tempos estao em segundos. As fases vem de --timings de
+# sensor_analysis_pthreads; sensor_analysis e sensor_analysis_ajustado so tem
+# o tempo total (sensor_analysis usa uma thread por CPU e o ajustado e
+# sequencial e para em 50000 registros validos).
+#
+# Uso: ./bench.sh [-l "LINHAS ..."] [-t "THREADS ..."] [-m "MODOS ..."]
+#                 [-r REPETICOES] [-b TAXA_INVALIDAS] [-o saida.csv]
+
+set -e
+
+linhas="100000 1000000"
+threads="1 2 4 $(nproc)"
+modos="parallel serial"
+repeticoes=3
+taxa=0.01
+saida=bench_resultados.csv
+
+while getopts "l:t:m:r:b:o:" opt; do
+    case $opt in
+        l) linhas=$OPTARG ;;
+        t) threads=$OPTARG ;;
+        m) modos=$OPTARG ;;
+        r) repeticoes=$OPTARG ;;
+        b) taxa=$OPTARG ;;
+        o) saida=$OPTARG ;;
+        *) sed -n '2,16p' "$0"; exit 1 ;;
+    esac
+done
+
+fonte=$(cd "$(dirname "$0")" && pwd)
+saida=$(realpath -m "$saida")
+trabalho=$(mktemp -d)
+trap 'rm -rf "$trabalho"' EXIT
+
+echo "Compilando em $trabalho"
+gcc -O2 -o "$trabalho/gerar_dados" "$fonte/gerar_dados.c"
+gcc -O2 -o "$trabalho/sensor_analysis_pthreads" "$fonte/sensor_analysis_pthreads.c" "$fonte/sensor_engine.c" -lpthread -lm
+gcc -O2 -o "$trabalho/sensor_analysis" "$fonte/sensor_analysis.c" -lpthread
+gcc -O2 -o "$trabalho/sensor_analysis_ajustado" "$fonte/sensor_analysis_ajustado.c"
+
+agora() {
+    date +%s.%N
+}
+
+# executa VARIANTE MODO LINHAS THREADS REPETICAO COMANDO...: roda o comando
+# no diretorio de trabalho (os analisadores gravam resultados.csv ali) e
+# acrescenta uma linha em $saida
+executa() {
+    local variante=$1 modo=$2 n=$3 t=$4 rep=$5
+    shift 5
+    local inicio fim fases
+    inicio=$(agora)
+    (cd "$trabalho" && "$@" > saida.txt)
+    fim=$(agora)
+    fases=$(grep '^tempos;' "$trabalho/saida.txt" | sed 's/^tempos;//; s/[a-z]*=//g')
+    [ -n "$fases" ] || fases=";;;"
+    echo "$variante;$modo;$n;$t;$rep;$(awk -v a="$inicio" -v b="$fim" 'BEGIN { printf "%.6f", b - a }');$fases" >> "$saida"
+}
+
+echo "variante;modo;linhas;threads;repeticao;total;leitura;agregacao;fusao;escrita" > "$saida"
+for n in $linhas; do
+    dados="$trabalho/dados_$n.csv"
+    echo "Gerando $n linhas"
+    "$trabalho/gerar_dados" --rows "$n" --bad-rate "$taxa" --seed 1 "$dados"
+
+    for rep in $(seq 1 "$repeticoes"); do
+        for modo in $modos; do
+            for t in $threads; do
+                executa sensor_analysis_pthreads "$modo" "$n" "$t" "$rep" \
+                    "$trabalho/sensor_analysis_pthreads" --mode "$modo" --threads "$t" --timings "$dados"
+            done
+        done
+        executa sensor_analysis - "$n" "$(nproc)" "$rep" "$trabalho/sensor_analysis" "$dados"
+        executa sensor_analysis_ajustado - "$n" 1 "$rep" "$trabalho/sensor_analysis_ajustado" "$dados"
+    done
+done
+echo "Resultados em $saida"
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Microbenchmark de falso compartilhamento: cada thread atualiza apenas o seu
+ * estado (contadores de progresso e um acumulador de min/max/soma, como as
+ * threads do motor fazem), mas os estados ficam lado a lado em um vetor. Sem
+ * padding, os estados de threads vizinhas dividem a mesma linha de cache e
+ * cada escrita invalida a copia das outras; com padding (como WorkerCtx em
+ * sensor_engine.c) cada estado ocupa sua propria linha.
+ *
+ * Compilacao: gcc -O2 -o bench_padding bench_padding.c -lpthread
+ * Uso: ./bench_padding [max_threads] [iteracoes_por_thread] */
+
+#define CACHE_LINE 64
+
+typedef struct {
+    atomic_llong registros;
+    float min;
+    float max;
+    float soma;
+} EstadoJunto;
+
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_llong registros;
+    float min;
+    float max;
+    float soma;
+} EstadoAlinhado;
+
+typedef struct {
+    void *estado;
+    bool alinhado;
+    long long iteracoes;
+    pthread_barrier_t *largada;
+} BenchArgs;
+
+/* O laco e o mesmo nas duas versoes; so muda o tipo do estado. As escritas
+ * atomicas relaxadas nos contadores impedem o compilador de mante-los em
+ * registradores, como acontece com contadores lidos por outra thread. */
+#define BENCH_LOOP(Tipo, p, n)                                                  \
+    do {                                                                        \
+        Tipo *e = (Tipo *)(p);                                                  \
+        for (long long i = 0; i < (n); i++) {                                   \
+            float v = (float)(i & 1023);                                        \
+            long long r = atomic_load_explicit(&e->registros, memory_order_relaxed); \
+            atomic_store_explicit(&e->registros, r + 1, memory_order_relaxed);  \
+            if (v < e->min) e->min = v;                                         \
+            if (v > e->max) e->max = v;                                         \
+            e->soma += v;                                                       \
+            __asm__ volatile("" : : "r"(e) : "memory");                         \
+        }                                                                       \
+    } while (0)
+
+void *bench_worker(void *arg) {
+    BenchArgs *args = (BenchArgs *)arg;
+    pthread_barrier_wait(args->largada);
+    if (args->alinhado) BENCH_LOOP(EstadoAlinhado, args->estado, args->iteracoes);
+    else BENCH_LOOP(EstadoJunto, args->estado, args->iteracoes);
+    return NULL;
+}
+
+double agora(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Executa o laco em num_threads threads e retorna milhoes de atualizacoes por
+ * segundo, somando todas as threads. */
+double run_bench(int num_threads, bool alinhado, long long iteracoes) {
+    size_t tamanho = alinhado ? sizeof(EstadoAlinhado) : sizeof(EstadoJunto);
+    size_t total = (num_threads * tamanho + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    char *estados = aligned_alloc(CACHE_LINE, total);
+    pthread_t *threads = malloc(num_threads * sizeof(pthread_t));
+    BenchArgs *args = malloc(num_threads * sizeof(BenchArgs));
+    if (!estados || !threads || !args) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    memset(estados, 0, total);
+
+    pthread_barrier_t largada;
+    pthread_barrier_init(&largada, NULL, num_threads + 1);
+    for (int i = 0; i < num_threads; i++) {
+        args[i].estado = estados + i * tamanho;
+        args[i].alinhado = alinhado;
+        args[i].iteracoes = iteracoes;
+        args[i].largada = &largada;
+        if (pthread_create(&threads[i], NULL, bench_worker, &args[i]) != 0) {
+            perror("Erro ao criar thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_barrier_wait(&largada);
+    double inicio = agora();
+    for (int i = 0; i < num_threads; i++) pthread_join(threads[i], NULL);
+    double segundos = agora() - inicio;
+
+    pthread_barrier_destroy(&largada);
+    free(estados);
+    free(threads);
+    free(args);
+    return num_threads * (double)iteracoes / segundos / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long long iteracoes = argc > 2 ? atoll(argv[2]) : 50000000LL;
+    if (max_threads < 1 || iteracoes < 1) {
+        printf("Uso: %s [max_threads] [iteracoes_por_thread]\n", argv[0]);
+        return 1;
+    }
+
+    printf("Estado por thread: %zu bytes sem padding, %zu com padding\n", sizeof(EstadoJunto), sizeof(EstadoAlinhado));
+    printf("%8s %18s %18s\n", "threads", "sem padding Mop/s", "com padding Mop/s");
+    // 1, 2, 4, ... e por ultimo max_threads
+    for (int n = 1;; n *= 2) {
+        if (n > max_threads) n = max_threads;
+        double junto = run_bench(n, false, iteracoes);
+        double alinhado = run_bench(n, true, iteracoes);
+        printf("%8d %18.1f %18.1f\n", n, junto, alinhado);
+        if (n == max_threads) break;
+    }
+    return 0;
+}
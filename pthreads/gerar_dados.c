@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+/* Gerador deterministico de CSV de sensores no formato de 12 campos separados
+ * por '|' lido pelos analisadores. A mesma semente e os mesmos parametros
+ * geram sempre o mesmo arquivo, byte a byte, entao os resultados do bench
+ * podem ser comparados entre versoes.
+ *
+ * Compilacao: gcc -O2 -o gerar_dados gerar_dados.c
+ * Uso: ./gerar_dados [--rows N] [--devices N] [--months N] [--start AAAA-MM]
+ *                    [--bad-rate TAXA] [--seed N] [saida.csv] */
+
+/* splitmix64: pequeno, rapido e igual em qualquer plataforma, ao contrario de
+ * rand(). */
+static uint64_t estado;
+
+static uint64_t proximo(void) {
+    uint64_t z = (estado += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+/* Inteiro uniforme em [0, n). */
+static unsigned sorteio(unsigned n) {
+    return (unsigned)(proximo() % n);
+}
+
+/* Valor com uma casa decimal em [min, max], no formato "%.1f". */
+static double decimal(int min, int max) {
+    return (min * 10 + (int)sorteio((max - min) * 10 + 1)) / 10.0;
+}
+
+void usage(const char *prog) {
+    printf("Uso: %s [--rows N] [--devices N] [--months N] [--start AAAA-MM] [--bad-rate TAXA]\n", prog);
+    printf("       [--seed N] [saida.csv]\n");
+    printf("  --rows N         linhas de dados, sem contar o cabecalho (padrao: 100000)\n");
+    printf("  --devices N      devices distintos (padrao: 24)\n");
+    printf("  --months N       meses distintos a partir de --start (padrao: 12)\n");
+    printf("  --start AAAA-MM  primeiro mes das datas (padrao: 2024-01)\n");
+    printf("  --bad-rate TAXA  fracao de linhas malformadas, de 0 a 1 (padrao: 0.01)\n");
+    printf("  --seed N         semente do gerador (padrao: 1)\n");
+    printf("Sem arquivo de saida, o CSV vai para a saida padrao.\n");
+}
+
+/* Linha malformada: um dos defeitos que todos os analisadores descartam
+ * (campo a menos, campo a mais, data zerada ou texto sem separadores). A data
+ * 0000-00-00 tem mes invalido para sensor_analysis_pthreads e fica antes de
+ * 2024-03 na comparacao de texto das outras versoes; um mes 13 em um ano
+ * valido passaria nelas e o bench compararia dados diferentes. */
+static void linha_invalida(FILE *f, long long id, int ano, int mes) {
+    switch (sorteio(4)) {
+        case 0:
+            fprintf(f, "%lld|sirrosteste_UCS_AMV-%02u|%u|%04d-%02d-01 00:00:00.000|20.0|50.0|100.0|60.0|400|100|-29.16\n",
+                    id, sorteio(100), sorteio(100), ano, mes);
+            break;
+        case 1:
+            fprintf(f, "%lld|sirrosteste_UCS_AMV-%02u|%u|%04d-%02d-01 00:00:00.000|20.0|50.0|100.0|60.0|400|100|-29.16|-51.10|extra\n",
+                    id, sorteio(100), sorteio(100), ano, mes);
+            break;
+        case 2:
+            fprintf(f, "%lld|sirrosteste_UCS_AMV-%02u|%u|0000-00-00 00:00:00.000|20.0|50.0|100.0|60.0|400|100|-29.16|-51.10\n",
+                    id, sorteio(100), sorteio(100));
+            break;
+        default:
+            fprintf(f, "linha corrompida %lld\n", id);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    long long linhas = 100000;
+    int devices = 24;
+    int meses = 12;
+    int ano_inicio = 2024, mes_inicio = 1;
+    double taxa_invalidas = 0.01;
+    unsigned long long semente = 1;
+
+    static struct option opcoes[] = {
+        {"rows", required_argument, NULL, 'r'},
+        {"devices", required_argument, NULL, 'd'},
+        {"months", required_argument, NULL, 'm'},
+        {"start", required_argument, NULL, 'i'},
+        {"bad-rate", required_argument, NULL, 'b'},
+        {"seed", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "r:d:m:i:b:s:", opcoes, NULL)) != -1) {
+        switch (opt) {
+            case 'r': linhas = atoll(optarg); break;
+            case 'd': devices = atoi(optarg); break;
+            case 'm': meses = atoi(optarg); break;
+            case 'i':
+                if (sscanf(optarg, "%4d-%2d", &ano_inicio, &mes_inicio) != 2 || mes_inicio < 1 || mes_inicio > 12) {
+                    printf("Mes invalido: %s (use AAAA-MM)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'b': taxa_invalidas = atof(optarg); break;
+            case 's': semente = strtoull(optarg, NULL, 10); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (linhas < 0 || devices < 1 || meses < 1 || taxa_invalidas < 0 || taxa_invalidas > 1 || optind < argc - 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *f = stdout;
+    if (optind == argc - 1) {
+        f = fopen(argv[optind], "w");
+        if (!f) {
+            perror("Erro ao criar arquivo");
+            return 1;
+        }
+    }
+    static char buffer[1 << 20];
+    setvbuf(f, buffer, _IOFBF, sizeof(buffer));
+
+    estado = semente;
+    uint64_t limite_invalidas = (uint64_t)(taxa_invalidas * (double)UINT32_MAX);
+    fprintf(f, "id|device|contagem|data|temperatura|umidade|luminosidade|ruido|eco2|etvoc|latitude|longitude\n");
+    for (long long i = 0; i < linhas; i++) {
+        int m = mes_inicio - 1 + (int)sorteio(meses);
+        int ano = ano_inicio + m / 12;
+        int mes = m % 12 + 1;
+        if ((proximo() & UINT32_MAX) < limite_invalidas) {
+            linha_invalida(f, i, ano, mes);
+            continue;
+        }
+
+        fprintf(f, "%lld|sirrosteste_UCS_AMV-%02u|%u|%04d-%02d-%02u %02u:%02u:%02u.%03u|%.1f|%.1f|%.1f|%.1f|%u|%u|%.5f|%.5f\n",
+                i, sorteio(devices), sorteio(100), ano, mes, 1 + sorteio(28), sorteio(24), sorteio(60), sorteio(60),
+                sorteio(1000), decimal(-10, 45), decimal(0, 100), decimal(0, 10000), decimal(30, 120), 400 + sorteio(4600),
+                sorteio(1000), -29.2 + sorteio(10000) / 100000.0, -51.1 + sorteio(10000) / 100000.0);
+    }
+
+    if (fclose(f) != 0) {
+        perror("Erro ao gravar arquivo");
+        return 1;
+    }
+    return 0;
+}
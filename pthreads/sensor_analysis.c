@@ -3,14 +3,15 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <unistd.h>
 
 #define MAX_LINE_LENGTH 1024
 #define MAX_FIELDS 12
-#define MAX_VALID_RECORDS 50000
+#define BATCH_RECORDS 50000
+#define CHUNK_RECORDS 2048  /* pedaco de trabalho distribuido entre as threads */
 
-#define MAX_GROUPS 10000
 #define MAX_SENSOR_NAME 20
 #define MAX_MONTH 8
 #define MAX_DEVICE 50
@@ -40,12 +41,34 @@ typedef struct {
     int count;
 } SensorStats;
 
+/* Tabela de grupos: os grupos ficam em itens, na ordem em que aparecem, e
+ * indice e um hash com enderecamento aberto (sondagem linear) que guarda a
+ * posicao de cada grupo em itens. Quando itens enche, os dois vetores dobram
+ * de tamanho, entao nao ha limite fixo de grupos. */
+typedef struct {
+    SensorStats *itens;
+    unsigned *hashes;
+    int count;
+    int cap;
+    int *indice;
+    int indice_cap;
+} StatsTable;
+
+/* Grupos agregados em um pedaco do lote, na ordem em que apareceram nele. */
+typedef struct {
+    SensorStats *itens;
+    int count;
+} ChunkResult;
+
+/* As threads pegam pedacos de CHUNK_RECORDS registros com um incremento
+ * atomico de proximo, entao uma thread lenta so atrasa o pedaco em que esta. */
 typedef struct {
     SensorData *data;
-    int start;
-    int end;
-    SensorStats *partial_stats;
-    int *partial_count;
+    int record_count;
+    int num_chunks;
+    atomic_int *proximo;
+    ChunkResult *resultados;
+    StatsTable *partial_stats;
 } ThreadData;
 
 bool is_empty(const char *str) {
@@ -66,18 +89,101 @@ char *trim(char *str) {
     return str;
 }
 
-int is_same_group(SensorStats *a, const char *device, const char *month, const char *sensor) {
-    return strcmp(a->device, device) == 0 && strcmp(a->month, month) == 0 && strcmp(a->sensor, sensor) == 0;
+/* Compara a chave do grupo; o device vem como ponteiro e tamanho, sem '\0'. */
+int is_same_group_n(SensorStats *a, const char *device, size_t device_len, const char *month, const char *sensor) {
+    return strncmp(a->device, device, device_len) == 0 && a->device[device_len] == '\0' &&
+           strcmp(a->month, month) == 0 && strcmp(a->sensor, sensor) == 0;
 }
 
-void *process_chunk(void *arg) {
-    ThreadData *tdata = (ThreadData *)arg;
-    SensorData *data = tdata->data;
-    SensorStats *partial_stats = tdata->partial_stats;
-    int *partial_count = tdata->partial_count;
-    int local_count = 0;
+unsigned group_hash(const char *device, size_t device_len, const char *month, const char *sensor) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < device_len; i++) h = (h ^ (unsigned char)device[i]) * 16777619u;
+    h = (h ^ '|') * 16777619u;
+    for (; *month; month++) h = (h ^ (unsigned char)*month) * 16777619u;
+    h = (h ^ '|') * 16777619u;
+    for (; *sensor; sensor++) h = (h ^ (unsigned char)*sensor) * 16777619u;
+    return h;
+}
+
+void stats_table_alloc(StatsTable *t, int cap) {
+    t->cap = cap;
+    t->indice_cap = cap * 2;
+    t->itens = realloc(t->itens, t->cap * sizeof(SensorStats));
+    t->hashes = realloc(t->hashes, t->cap * sizeof(unsigned));
+    free(t->indice);
+    t->indice = malloc(t->indice_cap * sizeof(int));
+    if (!t->itens || !t->hashes || !t->indice) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    memset(t->indice, -1, t->indice_cap * sizeof(int));
+
+    unsigned mask = t->indice_cap - 1;
+    for (int i = 0; i < t->count; i++) {
+        unsigned pos = t->hashes[i] & mask;
+        while (t->indice[pos] >= 0) pos = (pos + 1) & mask;
+        t->indice[pos] = i;
+    }
+}
+
+void stats_table_init(StatsTable *t) {
+    t->itens = NULL;
+    t->hashes = NULL;
+    t->indice = NULL;
+    t->count = 0;
+    stats_table_alloc(t, 256);
+}
+
+void stats_table_free(StatsTable *t) {
+    free(t->itens);
+    free(t->hashes);
+    free(t->indice);
+}
+
+/* Esvazia a tabela mantendo a memoria alocada. */
+void stats_table_clear(StatsTable *t) {
+    t->count = 0;
+    memset(t->indice, -1, t->indice_cap * sizeof(int));
+}
 
-    for (int i = tdata->start; i < tdata->end; i++) {
+/* Procura o grupo (device, month, sensor). Se nao existir, cria o grupo com
+ * essa chave e *novo fica true; o chamador inicializa os valores. */
+SensorStats *stats_table_get(StatsTable *t, const char *device, size_t device_len,
+                             const char *month, const char *sensor, bool *novo) {
+    unsigned h = group_hash(device, device_len, month, sensor);
+    unsigned mask = t->indice_cap - 1;
+    unsigned pos = h & mask;
+
+    while (t->indice[pos] >= 0) {
+        int k = t->indice[pos];
+        if (t->hashes[k] == h && is_same_group_n(&t->itens[k], device, device_len, month, sensor)) {
+            *novo = false;
+            return &t->itens[k];
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    if (t->count == t->cap) {
+        stats_table_alloc(t, t->cap * 2);
+        mask = t->indice_cap - 1;
+        pos = h & mask;
+        while (t->indice[pos] >= 0) pos = (pos + 1) & mask;
+    }
+
+    int k = t->count++;
+    SensorStats *g = &t->itens[k];
+    memcpy(g->device, device, device_len);
+    g->device[device_len] = '\0';
+    snprintf(g->month, sizeof(g->month), "%s", month);
+    snprintf(g->sensor, sizeof(g->sensor), "%s", sensor);
+    t->hashes[k] = h;
+    t->indice[pos] = k;
+    *novo = true;
+    return g;
+}
+
+void aggregate_range(SensorData *data, int start, int end, StatsTable *partial_stats) {
+    for (int i = start; i < end; i++) {
         SensorData s = data[i];
         char month[8];
         strncpy(month, s.date, 7);
@@ -95,51 +201,61 @@ void *process_chunk(void *arg) {
             {"etvoc", s.etvoc}
         };
 
+        size_t device_len = strlen(s.device);
         for (int j = 0; j < 6; j++) {
-            int found = 0;
-            for (int k = 0; k < local_count; k++) {
-                if (is_same_group(&partial_stats[k], s.device, month, sensors[j].name)) {
-                    if (sensors[j].value < partial_stats[k].min) partial_stats[k].min = sensors[j].value;
-                    if (sensors[j].value > partial_stats[k].max) partial_stats[k].max = sensors[j].value;
-                    partial_stats[k].sum += sensors[j].value;
-                    partial_stats[k].count++;
-                    found = 1;
-                    break;
-                }
-            }
-
-            if (!found && local_count < MAX_GROUPS) {
-                SensorStats *g = &partial_stats[local_count++];
-                strncpy(g->device, s.device, MAX_DEVICE);
-                strncpy(g->month, month, MAX_MONTH);
-                strncpy(g->sensor, sensors[j].name, MAX_SENSOR_NAME);
+            bool novo;
+            SensorStats *g = stats_table_get(partial_stats, s.device, device_len, month, sensors[j].name, &novo);
+            if (novo) {
                 g->min = g->max = g->sum = sensors[j].value;
                 g->count = 1;
+            } else {
+                if (sensors[j].value < g->min) g->min = sensors[j].value;
+                if (sensors[j].value > g->max) g->max = sensors[j].value;
+                g->sum += sensors[j].value;
+                g->count++;
             }
         }
     }
-
-    *partial_count = local_count;
-    return NULL;
 }
 
-void merge_stats(SensorStats *stats, int *total, SensorStats *partial, int partial_count) {
-    for (int i = 0; i < partial_count; i++) {
-        int found = 0;
-        for (int j = 0; j < *total; j++) {
-            if (is_same_group(&stats[j], partial[i].device, partial[i].month, partial[i].sensor)) {
-                if (partial[i].min < stats[j].min) stats[j].min = partial[i].min;
-                if (partial[i].max > stats[j].max) stats[j].max = partial[i].max;
-                stats[j].sum += partial[i].sum;
-                stats[j].count += partial[i].count;
-                found = 1;
-                break;
-            }
+/* Pega pedacos do lote ate acabarem. O resultado de cada pedaco e copiado
+ * para resultados[pedaco] e a tabela local e esvaziada para o proximo. */
+void *process_chunk(void *arg) {
+    ThreadData *tdata = (ThreadData *)arg;
+    StatsTable *partial_stats = tdata->partial_stats;
+    int c;
+
+    while ((c = atomic_fetch_add(tdata->proximo, 1)) < tdata->num_chunks) {
+        int start = c * CHUNK_RECORDS;
+        int end = start + CHUNK_RECORDS < tdata->record_count ? start + CHUNK_RECORDS : tdata->record_count;
+        aggregate_range(tdata->data, start, end, partial_stats);
+
+        ChunkResult *r = &tdata->resultados[c];
+        r->count = partial_stats->count;
+        r->itens = malloc((partial_stats->count + 1) * sizeof(SensorStats));
+        if (!r->itens) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
         }
+        memcpy(r->itens, partial_stats->itens, partial_stats->count * sizeof(SensorStats));
+        stats_table_clear(partial_stats);
+    }
 
-        if (!found && *total < MAX_GROUPS) {
-            stats[*total] = partial[i];
-            (*total)++;
+    return NULL;
+}
+
+void merge_stats(StatsTable *stats, const SensorStats *itens, int count) {
+    for (int i = 0; i < count; i++) {
+        const SensorStats *p = &itens[i];
+        bool novo;
+        SensorStats *g = stats_table_get(stats, p->device, strlen(p->device), p->month, p->sensor, &novo);
+        if (novo) {
+            *g = *p;
+        } else {
+            if (p->min < g->min) g->min = p->min;
+            if (p->max > g->max) g->max = p->max;
+            g->sum += p->sum;
+            g->count += p->count;
         }
     }
 }
@@ -166,19 +282,15 @@ void salvar_csv(SensorStats *stats, int total, const char *nome_arquivo) {
     printf("\nArquivo de resultados salvo como '%s'\n", nome_arquivo);
 }
 
-int read_csv(const char *filename, SensorData **data) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("Erro ao abrir arquivo");
-        return -1;
-    }
-
+/* Le ate max registros validos do arquivo, que fica aberto entre chamadas.
+ * O vetor records e reaproveitado a cada lote; total_lidos acumula o numero de
+ * registros validos ja lidos para as mensagens de progresso. */
+int read_batch(FILE *file, SensorData *records, int max, int *total_lidos) {
     char line[MAX_LINE_LENGTH];
-    SensorData *records = NULL;
     int record_count = 0;
     int line_number = 0;
 
-    while (fgets(line, sizeof(line), file)) {
+    while (record_count < max && fgets(line, sizeof(line), file)) {
         line_number++;
         line[strcspn(line, "\n")] = 0;
 
@@ -195,13 +307,6 @@ int read_csv(const char *filename, SensorData **data) {
 
         if (field_count != MAX_FIELDS) continue;
 
-        records = realloc(records, (record_count + 1) * sizeof(SensorData));
-        if (!records) {
-            perror("Erro de alocacao");
-            fclose(file);
-            return -1;
-        }
-
         memset(&records[record_count], 0, sizeof(SensorData));
         char *token = strtok(line, "|");
         for (int i = 0; i < MAX_FIELDS && token != NULL; i++) {
@@ -226,16 +331,14 @@ int read_csv(const char *filename, SensorData **data) {
         if (strlen(records[record_count].date) >= 7 &&
             strncmp(records[record_count].date, "2024-03", 7) >= 0) {
             record_count++;
-            if (record_count >= MAX_VALID_RECORDS) break;
-            if (record_count % 1000 == 0) {
-                printf("Lidas %d linhas validas ate agora...\n", record_count);
+            (*total_lidos)++;
+            if (*total_lidos % 1000 == 0) {
+                printf("Lidas %d linhas validas ate agora...\n", *total_lidos);
                 fflush(stdout);
             }
         }
     }
 
-    fclose(file);
-    *data = records;
     return record_count;
 }
 
@@ -248,42 +351,41 @@ void print_sample(SensorData *data, int count, int max) {
     }
 }
 
-void process_stats_with_threads(SensorData *data, int record_count, int num_threads) {
-    SensorStats stats[MAX_GROUPS];
-    int total_count = 0;
+/* Processa um lote com as threads e mescla o resultado em stats, que acumula
+ * os grupos de todos os lotes ja processados. */
+void process_stats_with_threads(SensorData *data, int record_count, int num_threads, StatsTable *stats) {
     pthread_t threads[num_threads];
     ThreadData tdata[num_threads];
-    SensorStats *partial_stats[num_threads];
-    int partial_counts[num_threads];
-
-    int chunk_size = record_count / num_threads;
-    int remaining = record_count % num_threads;
-    int start = 0;
+    StatsTable partial_stats[num_threads];
+
+    // O lote e dividido em pedacos de CHUNK_RECORDS registros, distribuidos
+    // sob demanda; os cortes nao dependem do numero de threads
+    int num_chunks = (record_count + CHUNK_RECORDS - 1) / CHUNK_RECORDS;
+    atomic_int proximo = 0;
+    ChunkResult *resultados = calloc(num_chunks + 1, sizeof(ChunkResult));
+    if (!resultados) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
 
     // Alocar memória para estatísticas parciais
     for (int i = 0; i < num_threads; i++) {
-        partial_stats[i] = malloc(MAX_GROUPS * sizeof(SensorStats));
-        if (!partial_stats[i]) {
-            perror("Erro ao alocar memória para estatísticas parciais");
-            exit(EXIT_FAILURE);
-        }
+        stats_table_init(&partial_stats[i]);
     }
 
     // Criar threads
     for (int i = 0; i < num_threads; i++) {
-        int end = start + chunk_size + (i < remaining ? 1 : 0);
         tdata[i].data = data;
-        tdata[i].start = start;
-        tdata[i].end = end;
-        tdata[i].partial_stats = partial_stats[i];
-        tdata[i].partial_count = &partial_counts[i];
+        tdata[i].record_count = record_count;
+        tdata[i].num_chunks = num_chunks;
+        tdata[i].proximo = &proximo;
+        tdata[i].resultados = resultados;
+        tdata[i].partial_stats = &partial_stats[i];
 
         if (pthread_create(&threads[i], NULL, process_chunk, &tdata[i])) {
             perror("Erro ao criar thread");
             exit(EXIT_FAILURE);
         }
-
-        start = end;
     }
 
     // Aguardar threads terminarem
@@ -291,26 +393,31 @@ void process_stats_with_threads(SensorData *data, int record_count, int num_thre
         pthread_join(threads[i], NULL);
     }
 
-    // Mesclar resultados parciais
+    // Mesclar os resultados na ordem dos pedacos, o que mantem os grupos na
+    // ordem do arquivo e as somas na mesma ordem em toda execucao
+    for (int c = 0; c < num_chunks; c++) {
+        merge_stats(stats, resultados[c].itens, resultados[c].count);
+        free(resultados[c].itens);
+    }
+    free(resultados);
     for (int i = 0; i < num_threads; i++) {
-        merge_stats(stats, &total_count, partial_stats[i], partial_counts[i]);
-        free(partial_stats[i]);
+        stats_table_free(&partial_stats[i]);
     }
+}
 
+void print_summary(const StatsTable *stats) {
     printf("\nResumo estatistico (agrupado por dispositivo, mes e sensor):\n");
-    for (int i = 0; i < total_count; i++) {
-        SensorStats *g = &stats[i];
+    for (int i = 0; i < stats->count; i++) {
+        SensorStats *g = &stats->itens[i];
         float media = g->sum / g->count;
         printf("Device: %s | Mes: %s | Sensor: %s | Min: %.2f | Max: %.2f | Media: %.2f\n",
                g->device, g->month, g->sensor, g->min, g->max, media);
     }
-
-    salvar_csv(stats, total_count, "resultados.csv");
 }
 
 int main(int argc, char *argv[]) {
     if (argc != 2) {
-        printf("Uso: %s <arquivo_entrada.csv>\n", argv[0]);
+        printf("Uso: %s <arquivo_entrada.csv | ->\n", argv[0]);
         return 1;
     }
 
@@ -319,18 +426,42 @@ int main(int argc, char *argv[]) {
     if (num_threads < 1) num_threads = 1;
     printf("Usando %d threads para processamento\n", num_threads);
 
-    SensorData *data = NULL;
+    // "-" le da entrada padrao
+    FILE *file = strcmp(argv[1], "-") == 0 ? stdin : fopen(argv[1], "r");
+    if (!file) {
+        perror("Erro ao abrir arquivo");
+        return 1;
+    }
+
+    // Os registros sao lidos e processados em lotes de BATCH_RECORDS, entao a
+    // memoria nao cresce com o tamanho da entrada
+    SensorData *data = malloc(BATCH_RECORDS * sizeof(SensorData));
+    if (!data) {
+        perror("Erro de alocacao");
+        return 1;
+    }
+    StatsTable stats;
+    stats_table_init(&stats);
+    int total_lidos = 0;
+    int batch_count;
+
     printf("Iniciando leitura do arquivo...\n");
-    int record_count = read_csv(argv[1], &data);
-    printf("Leitura concluida. Total de registros definidos para leitura: %d\n", record_count);
+    while ((batch_count = read_batch(file, data, BATCH_RECORDS, &total_lidos)) > 0) {
+        if (total_lidos == batch_count) print_sample(data, batch_count, 5);
+        process_stats_with_threads(data, batch_count, num_threads, &stats);
+    }
+    printf("Leitura concluida. Total de registros definidos para leitura: %d\n", total_lidos);
+    if (file != stdin) fclose(file);
+    free(data);
 
-    if (record_count <= 0) {
+    if (total_lidos <= 0) {
         printf("Nenhum dado valido encontrado.\n");
+        stats_table_free(&stats);
         return 1;
     }
 
-    print_sample(data, record_count, 5);
-    process_stats_with_threads(data, record_count, num_threads);
-    free(data);
+    print_summary(&stats);
+    salvar_csv(stats.itens, stats.count, "resultados.csv");
+    stats_table_free(&stats);
     return 0;
 }
\ No newline at end of file
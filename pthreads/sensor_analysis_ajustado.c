@@ -3,12 +3,12 @@
 #include <string.h>
 #include <stdbool.h>
 #include <ctype.h>
+#include <sys/stat.h>
 
 #define MAX_LINE_LENGTH 1024
 #define MAX_FIELDS 12
 #define MAX_VALID_RECORDS 50000
 
-#define MAX_GROUPS 10000
 #define MAX_SENSOR_NAME 20
 #define MAX_MONTH 8
 #define MAX_DEVICE 50
@@ -80,7 +80,14 @@ void salvar_csv(SensorStats *stats, int total, const char *nome_arquivo) {
 }
 
 void process_stats(SensorData *data, int record_count) {
-    SensorStats stats[MAX_GROUPS];
+    // Os grupos ficam no heap e o vetor dobra quando enche: um vetor fixo na
+    // pilha limitava o numero de grupos e ocupava ~1 MB da pilha
+    int capacity = 256;
+    SensorStats *stats = malloc(capacity * sizeof(SensorStats));
+    if (!stats) {
+        perror("Erro de alocacao");
+        return;
+    }
     int group_count = 0;
 
     for (int i = 0; i < record_count; i++) {
@@ -114,11 +121,21 @@ void process_stats(SensorData *data, int record_count) {
                 }
             }
 
-            if (!found && group_count < MAX_GROUPS) {
+            if (!found) {
+                if (group_count == capacity) {
+                    capacity *= 2;
+                    SensorStats *maior = realloc(stats, capacity * sizeof(SensorStats));
+                    if (!maior) {
+                        perror("Erro de alocacao");
+                        free(stats);
+                        return;
+                    }
+                    stats = maior;
+                }
                 SensorStats *g = &stats[group_count++];
-                strncpy(g->device, s.device, MAX_DEVICE);
-                strncpy(g->month, month, MAX_MONTH);
-                strncpy(g->sensor, sensors[j].name, MAX_SENSOR_NAME);
+                snprintf(g->device, sizeof(g->device), "%s", s.device);
+                snprintf(g->month, sizeof(g->month), "%s", month);
+                snprintf(g->sensor, sizeof(g->sensor), "%s", sensors[j].name);
                 g->min = g->max = g->sum = sensors[j].value;
                 g->count = 1;
             }
@@ -134,7 +151,28 @@ void process_stats(SensorData *data, int record_count) {
     }
 
     salvar_csv(stats, group_count, "resultados.csv");
+    free(stats);
 }
+
+/* Estima o numero de linhas de um arquivo regular pelo tamanho dele e pelo
+ * comprimento medio das linhas do primeiro bloco, e volta o arquivo para o
+ * inicio. Retorna 0 se nao der para estimar. */
+static size_t estimate_lines(FILE *file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+
+    char amostra[1 << 16];
+    size_t lidos = fread(amostra, 1, sizeof(amostra), file);
+    rewind(file);
+
+    size_t linhas = 0;
+    for (size_t i = 0; i < lidos; i++) {
+        if (amostra[i] == '\n') linhas++;
+    }
+    if (linhas == 0) return 1;
+    return (size_t)st.st_size / (lidos / linhas) + 1;
+}
+
 int read_csv(const char *filename, SensorData **data) {
     FILE *file = fopen(filename, "r");
     if (!file) {
@@ -145,8 +183,22 @@ int read_csv(const char *filename, SensorData **data) {
     char line[MAX_LINE_LENGTH];
     SensorData *records = NULL;
     int record_count = 0;
+    int capacity = 0;
     int line_number = 0;
 
+    // Reserva o vetor pelo numero estimado de linhas (limitado a
+    // MAX_VALID_RECORDS); se faltar espaco, a capacidade dobra
+    size_t estimativa = estimate_lines(file);
+    if (estimativa > 0) {
+        capacity = estimativa < MAX_VALID_RECORDS ? (int)estimativa : MAX_VALID_RECORDS;
+        records = malloc(capacity * sizeof(SensorData));
+        if (!records) {
+            perror("Erro de alocacao");
+            fclose(file);
+            return -1;
+        }
+    }
+
     while (fgets(line, sizeof(line), file)) {
         line_number++;
         line[strcspn(line, "\n")] = 0;
@@ -164,11 +216,16 @@ int read_csv(const char *filename, SensorData **data) {
 
         if (field_count != MAX_FIELDS) continue;
 
-        records = realloc(records, (record_count + 1) * sizeof(SensorData));
-        if (!records) {
-            perror("Erro de alocacao");
-            fclose(file);
-            return -1;
+        if (record_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            SensorData *maior = realloc(records, capacity * sizeof(SensorData));
+            if (!maior) {
+                perror("Erro de alocacao");
+                free(records);
+                fclose(file);
+                return -1;
+            }
+            records = maior;
         }
 
         memset(&records[record_count], 0, sizeof(SensorData));
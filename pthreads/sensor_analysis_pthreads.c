@@ -1,272 +1,429 @@
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <stdbool.h>
-#include <ctype.h>
-#include <pthread.h>
+#include <limits.h>
+#include <time.h>
 #include <unistd.h>
-
-#define MAX_LINE_LENGTH 1024
-#define MAX_FIELDS 12
-#define MAX_GROUPS 10000
-#define MAX_SENSOR_NAME 20
-#define MAX_MONTH 8
-#define MAX_DEVICE 50
-
-typedef struct {
-    int id;
-    char device[50];
-    int count;
-    char date[20];
-    float temperature;
-    float humidity;
-    float luminosity;
-    float noise;
-    float eco2;
-    float etvoc;
-    float latitude;
-    float longitude;
-} SensorData;
-
-typedef struct {
-    char device[MAX_DEVICE];
-    char month[MAX_MONTH];
-    char sensor[MAX_SENSOR_NAME];
-    float min;
-    float max;
-    float sum;
-    int count;
-} SensorStats;
-
-typedef struct {
-    SensorData *data;
-    int start;
-    int end;
-    SensorStats *local_stats;
-    int *local_count;
-} ThreadArgs;
-
-bool is_empty(const char *str) {
-    while (*str) {
-        if (!isspace((unsigned char)*str)) return false;
-        str++;
-    }
-    return true;
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "sensor_engine.h"
+
+void usage(const char *prog) {
+    printf("Uso: %s [--mode serial|parallel|stream|pipeline] [--engine hash|dense] [--simd auto|avx2|sse|scalar]\n", prog);
+    printf("       [--threads N] [--cpus LISTA] [--numa] [--from AAAA-MM] [--to AAAA-MM] [--granularity LISTA]\n");
+    printf("       [--percentiles LISTA]\n");
+    printf("       [--checkpoint ARQUIVO] [--timings] [--stats ARQUIVO] [--profile] [--convert]\n");
+    printf("       <arquivo_entrada.csv | ->\n");
+    printf("  --mode parallel  mapeia o arquivo e cada thread agrega sua faixa (padrao)\n");
+    printf("  --mode serial    le o arquivo inteiro antes de criar as threads\n");
+    printf("  --mode stream    agrega cada linha ao ler, sem guardar os registros\n");
+    printf("  --mode pipeline  uma thread le blocos do arquivo enquanto as outras agregam\n");
+    printf("                   os blocos ja lidos (aceita pipes)\n");
+    printf("  --engine hash    agrupa por tabela hash (padrao)\n");
+    printf("  --engine dense   descobre devices e meses antes e agrega em um vetor\n");
+    printf("                   [device][mes][sensor]; volta para hash se o espaco de\n");
+    printf("                   chaves for grande demais ou no modo stream\n");
+    printf("  --simd NIVEL     kernels de min/max/media; auto escolhe o melhor que a CPU\n");
+    printf("                   suporta (padrao)\n");
+    printf("  --threads N      numero de threads (padrao: uma por CPU)\n");
+    printf("  --cpus LISTA     fixa as threads nas CPUs da lista, como 0-7,16-23\n");
+    printf("  --numa           fixa as threads agrupadas por no NUMA e deixa os dados de\n");
+    printf("                   cada thread na memoria do seu no\n");
+    printf("  --from AAAA-MM   primeiro mes agregado (padrao: 2024-03)\n");
+    printf("  --to AAAA-MM     ultimo mes agregado (padrao: sem limite)\n");
+    printf("  --granularity L  agrupa pelos periodos da lista (hour, day, week, month),\n");
+    printf("                   como hour,day,month, em uma unica leitura, e grava um\n");
+    printf("                   resultados_<periodo>.csv por periodo em vez de\n");
+    printf("                   resultados.csv (padrao: so month)\n");
+    printf("  --percentiles L  acrescenta a resultados.csv os percentis aproximados da\n");
+    printf("                   lista, como 50,95,99 (erro de ate ~1,6%% do valor, ou\n");
+    printf("                   1/240 do maior valor absoluto do mesmo sinal para valores\n");
+    printf("                   bem menores que ele; usa o motor hash)\n");
+    printf("  --checkpoint ARQ modo incremental: carrega de ARQ o estado da ultima execucao,\n");
+    printf("                   agrega so as linhas acrescentadas ao arquivo desde entao e\n");
+    printf("                   grava o novo estado em ARQ (usa sempre a leitura parallel)\n");
+    printf("  --timings        imprime o tempo de cada fase (leitura, agregacao, fusao e\n");
+    printf("                   escrita) em uma linha \"tempos;...\" no fim\n");
+    printf("  --stats ARQ      grava em ARQ (ou na saida padrao, com '-') um JSON com\n");
+    printf("                   tempo de parede e de CPU de cada fase, registros/s, MB/s e\n");
+    printf("                   registros, tempo ocupado e ocioso de cada thread; com '-'\n");
+    printf("                   as demais mensagens vao para a saida de erro\n");
+    printf("  --profile        inclui no JSON de --stats (padrao: saida padrao) os\n");
+    printf("                   contadores de ciclos, falhas de cache e desvios errados\n");
+    printf("  --convert        grava o cache colunar arquivo_entrada.csv.scb e sai; nas\n");
+    printf("                   proximas execucoes (parallel e serial) o cache e usado no\n");
+    printf("                   lugar do CSV enquanto for mais novo que ele\n");
+    printf("Com '-' (ou entrada que nao e arquivo regular) os dados vem da entrada padrao\n");
+    printf("e o modo stream e usado, a menos que --mode pipeline seja pedido.\n");
 }
 
-char *trim(char *str) {
-    char *end;
-    while (isspace((unsigned char)*str)) str++;
-    if (*str == 0) return str;
-    end = str + strlen(str) - 1;
-    while (end > str && isspace((unsigned char)*end)) end--;
-    end[1] = '\0';
-    return str;
+double relogio(clockid_t relogio) {
+    struct timespec ts;
+    clock_gettime(relogio, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-int is_same_group(SensorStats *a, const char *device, const char *month, const char *sensor) {
-    return strcmp(a->device, device) == 0 && strcmp(a->month, month) == 0 && strcmp(a->sensor, sensor) == 0;
+double agora(void) {
+    return relogio(CLOCK_MONOTONIC);
 }
 
-void* thread_worker(void* arg) {
-    ThreadArgs *args = (ThreadArgs*) arg;
-    SensorData *data = args->data;
-    SensorStats *stats = args->local_stats;
-    int group_count = 0;
-
-    for (int i = args->start; i < args->end; i++) {
-        SensorData s = data[i];
-        char month[8];
-        strncpy(month, s.date, 7);
-        month[7] = '\0';
-
-        struct {
-            const char *name;
-            float value;
-        } sensors[] = {
-            {"temperature", s.temperature},
-            {"humidity", s.humidity},
-            {"luminosity", s.luminosity},
-            {"noise", s.noise},
-            {"eco2", s.eco2},
-            {"etvoc", s.etvoc}
-        };
+static const char *mode_names[] = {"parallel", "serial", "stream", "pipeline"};
+static const char *engine_names[] = {"hash", "dense"};
 
-        for (int j = 0; j < 6; j++) {
-            int found = 0;
-            for (int k = 0; k < group_count; k++) {
-                if (is_same_group(&stats[k], s.device, month, sensors[j].name)) {
-                    if (sensors[j].value < stats[k].min) stats[k].min = sensors[j].value;
-                    if (sensors[j].value > stats[k].max) stats[k].max = sensors[j].value;
-                    stats[k].sum += sensors[j].value;
-                    stats[k].count++;
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found && group_count < MAX_GROUPS) {
-                SensorStats *g = &stats[group_count++];
-                strncpy(g->device, s.device, MAX_DEVICE);
-                strncpy(g->month, month, MAX_MONTH);
-                strncpy(g->sensor, sensors[j].name, MAX_SENSOR_NAME);
-                g->min = g->max = g->sum = sensors[j].value;
-                g->count = 1;
-            }
-        }
+/* Medidas de uma execucao para --stats. bytes e -1 quando o tamanho da
+ * entrada nao e conhecido (pipe); contadores so vale com perfil. */
+typedef struct {
+    const char *arquivo;
+    RunMode mode;
+    Engine engine;
+    bool incremental;
+    long long bytes;
+    int grupos;
+    EngineTimings fases;
+    double escrita;
+    double escrita_cpu;
+    int num_threads;
+    ThreadStats *threads;
+    bool perfil;
+    long long contadores[NUM_PERF_COUNTERS];
+} RunStats;
+
+void json_string(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(f, "\\%c", c);
+        else if (c < 0x20) fprintf(f, "\\u%04x", c);
+        else fputc(c, f);
     }
-
-    *args->local_count = group_count;
-    return NULL;
+    fputc('"', f);
 }
 
-void salvar_csv(SensorStats *stats, int total, const char *nome_arquivo) {
-    FILE *fp = fopen(nome_arquivo, "w");
-    if (!fp) {
-        perror("Erro ao criar arquivo de saida");
-        return;
-    }
-
-    fprintf(fp, "device;ano-mes;sensor;valor_maximo;valor_medio;valor_minimo\n");
-    for (int i = 0; i < total; i++) {
-        SensorStats *g = &stats[i];
-        float media = g->sum / g->count;
-        fprintf(fp, "%s;%s;%s;%.2f;%.2f;%.2f\n", g->device, g->month, g->sensor, g->max, media, g->min);
-    }
-
-    fclose(fp);
-    printf("\nArquivo de resultados salvo como '%s'\n", nome_arquivo);
+void json_phase(FILE *f, const char *nome, double parede, double cpu, bool ultima) {
+    fprintf(f, "    \"%s\": {\"parede_s\": %.6f, \"cpu_s\": %.6f}%s\n", nome, parede, cpu, ultima ? "" : ",");
 }
 
-int read_csv(const char *filename, SensorData **data) {
-    FILE *file = fopen(filename, "r");
-    if (!file) {
-        perror("Erro ao abrir arquivo");
+/* Grava as medidas de r como JSON em destino ("-" para a saida padrao). As
+ * taxas usam o tempo do motor (leitura, agregacao e fusao), sem a escrita. */
+int salvar_stats(const RunStats *r, const char *destino, FILE *saida_padrao) {
+    FILE *f = strcmp(destino, "-") == 0 ? saida_padrao : fopen(destino, "w");
+    if (!f) {
+        perror("Erro ao criar arquivo de estatisticas");
         return -1;
     }
 
-    char line[MAX_LINE_LENGTH];
-    SensorData *records = NULL;
-    int record_count = 0;
-
-    while (fgets(line, sizeof(line), file)) {
-        line[strcspn(line, "\n")] = 0;
-
-        char line_copy[MAX_LINE_LENGTH];
-        strncpy(line_copy, line, MAX_LINE_LENGTH);
-        line_copy[MAX_LINE_LENGTH - 1] = '\0';
-
-        int field_count = 0;
-        char *tok = strtok(line_copy, "|");
-        while (tok) {
-            field_count++;
-            tok = strtok(NULL, "|");
-        }
-
-        if (field_count != MAX_FIELDS) continue;
-
-        records = realloc(records, (record_count + 1) * sizeof(SensorData));
-        if (!records) {
-            perror("Erro de alocacao");
-            fclose(file);
-            return -1;
-        }
-
-        memset(&records[record_count], 0, sizeof(SensorData));
-        char *token = strtok(line, "|");
-        for (int i = 0; i < MAX_FIELDS && token != NULL; i++) {
-            char *clean = trim(token);
-            switch (i) {
-                case 0: if (!is_empty(clean)) records[record_count].id = atoi(clean); break;
-                case 1: if (!is_empty(clean)) strncpy(records[record_count].device, clean, sizeof(records[record_count].device) - 1); break;
-                case 2: if (!is_empty(clean)) records[record_count].count = atoi(clean); break;
-                case 3: if (!is_empty(clean)) strncpy(records[record_count].date, clean, sizeof(records[record_count].date) - 1); break;
-                case 4: if (!is_empty(clean)) records[record_count].temperature = atof(clean); break;
-                case 5: if (!is_empty(clean)) records[record_count].humidity = atof(clean); break;
-                case 6: if (!is_empty(clean)) records[record_count].luminosity = atof(clean); break;
-                case 7: if (!is_empty(clean)) records[record_count].noise = atof(clean); break;
-                case 8: if (!is_empty(clean)) records[record_count].eco2 = atof(clean); break;
-                case 9: if (!is_empty(clean)) records[record_count].etvoc = atof(clean); break;
-                case 10: if (!is_empty(clean)) records[record_count].latitude = atof(clean); break;
-                case 11: if (!is_empty(clean)) records[record_count].longitude = atof(clean); break;
-            }
-            token = strtok(NULL, "|");
-        }
-
-        if (strlen(records[record_count].date) >= 7 &&
-            strncmp(records[record_count].date, "2024-03", 7) >= 0) {
-            record_count++;
+    const EngineTimings *t = &r->fases;
+    double motor = t->leitura + t->agregacao + t->fusao;
+    long long registros = 0;
+    for (int i = 0; i < r->num_threads; i++) registros += r->threads[i].registros;
+
+    fprintf(f, "{\n  \"arquivo\": ");
+    json_string(f, r->arquivo);
+    fprintf(f, ",\n  \"modo\": \"%s\",\n  \"motor\": \"%s\",\n  \"incremental\": %s,\n", mode_names[r->mode],
+            engine_names[r->engine], r->incremental ? "true" : "false");
+    fprintf(f, "  \"threads\": %d,\n  \"registros\": %lld,\n  \"grupos\": %d,\n", r->num_threads, registros, r->grupos);
+    if (r->bytes >= 0) fprintf(f, "  \"bytes\": %lld,\n", r->bytes);
+    else fprintf(f, "  \"bytes\": null,\n");
+    fprintf(f, "  \"fases\": {\n");
+    json_phase(f, "leitura", t->leitura, t->leitura_cpu, false);
+    json_phase(f, "agregacao", t->agregacao, t->agregacao_cpu, false);
+    json_phase(f, "fusao", t->fusao, t->fusao_cpu, false);
+    json_phase(f, "escrita", r->escrita, r->escrita_cpu, false);
+    json_phase(f, "total", motor + r->escrita, t->leitura_cpu + t->agregacao_cpu + t->fusao_cpu + r->escrita_cpu, true);
+    fprintf(f, "  },\n");
+    fprintf(f, "  \"registros_por_s\": %.1f,\n", motor > 0 ? registros / motor : 0.0);
+    if (r->bytes >= 0) fprintf(f, "  \"mb_por_s\": %.3f,\n", motor > 0 ? r->bytes / 1e6 / motor : 0.0);
+    else fprintf(f, "  \"mb_por_s\": null,\n");
+
+    fprintf(f, "  \"por_thread\": [\n");
+    for (int i = 0; i < r->num_threads; i++) {
+        const ThreadStats *s = &r->threads[i];
+        fprintf(f, "    {\"id\": %d, \"cpu_fixada\": %d, \"pedacos\": %lld, \"registros\": %lld, "
+                   "\"ocupado_s\": %.6f, \"cpu_s\": %.6f, \"ocioso_s\": %.6f}%s\n",
+                i, s->cpu_fixada, s->pedacos, s->registros, s->ocupado, s->cpu, s->ocioso,
+                i + 1 < r->num_threads ? "," : "");
+    }
+    fprintf(f, "  ]");
+
+    if (r->perfil) {
+        fprintf(f, ",\n  \"contadores\": {");
+        for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+            fprintf(f, "%s\"%s\": ", i ? ", " : "", perf_counter_names[i]);
+            if (r->contadores[i] >= 0) fprintf(f, "%lld", r->contadores[i]);
+            else fprintf(f, "null");
         }
+        fprintf(f, "}");
     }
+    fprintf(f, "\n}\n");
 
-    fclose(file);
-    *data = records;
-    return record_count;
+    return fclose(f) == 0 ? 0 : -1;
 }
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("Uso: %s <arquivo_entrada.csv>\n", argv[0]);
+    RunMode mode = MODE_PARALLEL;
+    Engine engine = ENGINE_HASH;
+    SimdLevel simd = SIMD_AUTO;
+    EngineConfig cfg = {0, NULL, 0, false};
+    int *cpus = NULL;
+    bool converter = false;
+    const char *checkpoint = NULL;
+    bool tempos = false;
+    const char *stats_destino = NULL;
+    bool perfil = false;
+    int mes_de = parse_month("2024-03", 7);
+    int mes_ate = INT_MAX;
+    Granularity niveis[NUM_GRANULARITIES];
+    int num_niveis = 0;
+
+    static struct option opcoes[] = {
+        {"mode", required_argument, NULL, 'm'},
+        {"engine", required_argument, NULL, 'e'},
+        {"simd", required_argument, NULL, 's'},
+        {"threads", required_argument, NULL, 't'},
+        {"cpus", required_argument, NULL, 'c'},
+        {"numa", no_argument, NULL, 'n'},
+        {"from", required_argument, NULL, 'f'},
+        {"to", required_argument, NULL, 'u'},
+        {"granularity", required_argument, NULL, 'g'},
+        {"percentiles", required_argument, NULL, 'q'},
+        {"checkpoint", required_argument, NULL, 'p'},
+        {"timings", no_argument, NULL, 'T'},
+        {"stats", required_argument, NULL, 'S'},
+        {"profile", no_argument, NULL, 'P'},
+        {"convert", no_argument, NULL, 'k'},
+        {NULL, 0, NULL, 0}
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "m:e:s:t:c:nf:u:g:q:p:TS:Pk", opcoes, NULL)) != -1) {
+        switch (opt) {
+            case 'm':
+                if (strcmp(optarg, "serial") == 0) mode = MODE_SERIAL;
+                else if (strcmp(optarg, "parallel") == 0) mode = MODE_PARALLEL;
+                else if (strcmp(optarg, "stream") == 0) mode = MODE_STREAM;
+                else if (strcmp(optarg, "pipeline") == 0) mode = MODE_PIPELINE;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'e':
+                if (strcmp(optarg, "hash") == 0) engine = ENGINE_HASH;
+                else if (strcmp(optarg, "dense") == 0) engine = ENGINE_DENSE;
+                else {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 's': {
+                bool valido = false;
+                for (int i = SIMD_AUTO; i <= SIMD_AVX2; i++) {
+                    if (strcmp(optarg, simd_names[i]) == 0) {
+                        simd = i;
+                        valido = true;
+                    }
+                }
+                if (!valido) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 't':
+                cfg.num_threads = atoi(optarg);
+                if (cfg.num_threads < 1) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                free(cpus);
+                cfg.num_cpus = parse_cpu_list(optarg, &cpus);
+                if (cfg.num_cpus < 0) {
+                    printf("Lista de CPUs invalida: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'n':
+                cfg.numa = true;
+                break;
+            case 'f':
+            case 'u': {
+                int mes = strlen(optarg) == 7 ? parse_month(optarg, 7) : -1;
+                if (mes < 0) {
+                    printf("Mes invalido: %s (use AAAA-MM)\n", optarg);
+                    return 1;
+                }
+                if (opt == 'f') mes_de = mes;
+                else mes_ate = mes;
+                break;
+            }
+            case 'g':
+                num_niveis = granularity_init(optarg, niveis);
+                if (num_niveis <= 0) {
+                    printf("Lista de granularidades invalida: %s (use hour, day, week e month, como hour,day)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'q':
+                if (percentiles_init(optarg) <= 0) {
+                    printf("Lista de percentis invalida: %s (use valores de 0 a 100, como 50,95,99)\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'p':
+                checkpoint = optarg;
+                break;
+            case 'T':
+                tempos = true;
+                break;
+            case 'S':
+                stats_destino = optarg;
+                break;
+            case 'P':
+                perfil = true;
+                break;
+            case 'k':
+                converter = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
         return 1;
     }
-
-    SensorData *data = NULL;
-    int record_count = read_csv(argv[1], &data);
-    if (record_count <= 0) {
-        printf("Nenhum dado valido encontrado.\n");
+    if (mes_de > mes_ate) {
+        printf("Intervalo de meses vazio: --from depois de --to\n");
         return 1;
     }
-
-    int num_threads = sysconf(_SC_NPROCESSORS_ONLN);
-    pthread_t threads[num_threads];
-    ThreadArgs args[num_threads];
-    SensorStats *thread_stats[num_threads];
-    int local_counts[num_threads];
-
-    int bloco = record_count / num_threads;
-
-    for (int i = 0; i < num_threads; i++) {
-        int start = i * bloco;
-        int end = (i == num_threads - 1) ? record_count : start + bloco;
-
-        thread_stats[i] = calloc(MAX_GROUPS, sizeof(SensorStats));
-        args[i].data = data;
-        args[i].start = start;
-        args[i].end = end;
-        args[i].local_stats = thread_stats[i];
-        args[i].local_count = &local_counts[i];
-
-        pthread_create(&threads[i], NULL, thread_worker, &args[i]);
+    const char *filename = argv[optind];
+    if (converter) {
+        char *destino = scb_cache_path(filename);
+        int registros = scb_convert(filename, destino);
+        if (registros >= 0) printf("Cache colunar salvo como '%s' (%d registros)\n", destino, registros);
+        free(destino);
+        free(cpus);
+        return registros < 0;
+    }
+    if (checkpoint && !is_regular_file(filename)) {
+        printf("--checkpoint precisa de um arquivo regular\n");
+        free(cpus);
+        return 1;
+    }
+    if (!is_regular_file(filename) && mode != MODE_PIPELINE) mode = MODE_STREAM;
+    simd_init(simd);
+    date_filter_init(mes_de, mes_ate);
+
+    // Sem --cpus, o modo NUMA usa as CPUs permitidas agrupadas por no, para
+    // que threads vizinhas (e seus trechos da entrada) fiquem no mesmo no
+    if (cfg.numa && !cpus) cfg.num_cpus = numa_cpus(&cpus);
+    if (cfg.num_cpus <= 0) cfg.num_cpus = 0;
+    cfg.cpus = cpus;
+    if (cfg.num_threads == 0) {
+        cfg.num_threads = cfg.num_cpus > 0 ? cfg.num_cpus : sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (perfil && !stats_destino) stats_destino = "-";
+
+    // Com o JSON na saida padrao, ele fica com uma copia do descritor e as
+    // mensagens do programa e do motor passam para a saida de erro, para que
+    // a saida padrao seja so o JSON
+    FILE *saida_json = stdout;
+    if (stats_destino && strcmp(stats_destino, "-") == 0) {
+        fflush(stdout);
+        int fd = dup(STDOUT_FILENO);
+        saida_json = fd >= 0 ? fdopen(fd, "w") : NULL;
+        if (!saida_json || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+            perror("Erro ao separar a saida do JSON");
+            return 1;
+        }
     }
 
-    SensorStats merged[MAX_GROUPS];
-    int merged_count = 0;
-
-    for (int i = 0; i < num_threads; i++) {
-        pthread_join(threads[i], NULL);
+    // Os contadores precisam ser abertos antes de o pool ser criado, para
+    // que as threads herdem a contagem
+    PerfCounters contadores;
+    if (perfil) perf_counters_start(&contadores);
+
+    RunStats medidas = {0};
+    medidas.arquivo = filename;
+    medidas.mode = mode;
+    medidas.engine = engine;
+    medidas.incremental = checkpoint != NULL;
+    medidas.bytes = -1;
+    medidas.perfil = perfil;
+    struct stat st;
+    if (is_regular_file(filename) && stat(filename, &st) == 0) medidas.bytes = st.st_size;
+
+    SensorEngine *motor = engine_create_config(&cfg);
+    StatsTable merged;
+    stats_table_init(&merged);
+
+    if (checkpoint) {
+        // O checkpoint guarda os grupos ate o fim da ultima linha agregada;
+        // so o que foi acrescentado depois disso e lido
+        size_t inicio = 0, fim;
+        if (checkpoint_load(checkpoint, filename, &merged, &inicio) == 0) {
+            printf("Checkpoint '%s': %zu bytes ja agregados\n", checkpoint, inicio);
+        }
+        if (engine_run_tail(motor, filename, inicio, engine, &merged, &fim) == 0) {
+            printf("Agregados %zu bytes novos\n", fim - inicio);
+            checkpoint_save(checkpoint, filename, &merged, fim);
+            medidas.bytes = fim - inicio;
+        }
+    } else {
+        engine_run(motor, filename, mode, engine, &merged);
+    }
 
-        for (int j = 0; j < local_counts[i]; j++) {
-            SensorStats *s = &thread_stats[i][j];
-            int found = 0;
-            for (int k = 0; k < merged_count; k++) {
-                if (is_same_group(&merged[k], s->device, s->month, s->sensor)) {
-                    if (s->min < merged[k].min) merged[k].min = s->min;
-                    if (s->max > merged[k].max) merged[k].max = s->max;
-                    merged[k].sum += s->sum;
-                    merged[k].count += s->count;
-                    found = 1;
-                    break;
-                }
-            }
-            if (!found && merged_count < MAX_GROUPS) {
-                merged[merged_count++] = *s;
+    int merged_count = merged.count;
+    double inicio_escrita = agora();
+    double inicio_escrita_cpu = relogio(CLOCK_PROCESS_CPUTIME_ID);
+    if (merged_count == 0) {
+        printf("Nenhum dado valido encontrado.\n");
+    } else if (num_niveis == 0) {
+        salvar_csv(&merged, "resultados.csv");
+    } else {
+        // Os periodos mais grossos saem dos grupos ja agregados na
+        // granularidade base, sem reler a entrada
+        for (int i = 0; i < num_niveis; i++) {
+            char nome[64];
+            snprintf(nome, sizeof(nome), "resultados_%s.csv", granularity_names[niveis[i]]);
+            if (niveis[i] == merged.granularidade) {
+                salvar_csv(&merged, nome);
+                continue;
             }
+            StatsTable agrupada;
+            stats_table_init(&agrupada);
+            stats_table_rollup(&merged, niveis[i], &agrupada);
+            salvar_csv(&agrupada, nome);
+            stats_table_free(&agrupada);
         }
-
-        free(thread_stats[i]);
     }
-
-    salvar_csv(merged, merged_count, "resultados.csv");
-    free(data);
-    return 0;
+    medidas.escrita = agora() - inicio_escrita;
+    medidas.escrita_cpu = relogio(CLOCK_PROCESS_CPUTIME_ID) - inicio_escrita_cpu;
+    engine_timings(motor, &medidas.fases);
+    if (tempos) {
+        // Uma linha so, facil de extrair por scripts (bench.sh)
+        const EngineTimings *t = &medidas.fases;
+        printf("tempos;leitura=%.6f;agregacao=%.6f;fusao=%.6f;escrita=%.6f\n", t->leitura, t->agregacao, t->fusao,
+               medidas.escrita);
+    }
+    medidas.grupos = merged_count;
+    medidas.num_threads = engine_num_threads(motor);
+    medidas.threads = malloc(medidas.num_threads * sizeof(ThreadStats));
+    if (!medidas.threads) {
+        perror("Erro de alocacao");
+        return 1;
+    }
+    for (int i = 0; i < medidas.num_threads; i++) engine_thread_stats(motor, i, &medidas.threads[i]);
+    stats_table_free(&merged);
+    engine_destroy(motor);
+
+    // So depois de engine_destroy os contadores incluem as threads do pool
+    if (perfil) perf_counters_read(&contadores, medidas.contadores);
+    int erro_stats = stats_destino ? salvar_stats(&medidas, stats_destino, saida_json) : 0;
+    free(medidas.threads);
+    free(cpus);
+    return merged_count == 0 || erro_stats != 0;
 }
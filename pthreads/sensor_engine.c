@@ -0,0 +1,3529 @@
+
+#define _GNU_SOURCE
+#include "sensor_engine.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+#define MAX_LINE_LENGTH 1024
+#define MAX_FIELDS 12
+#define MAX_DEVICE 50
+#define FIRST_MONTH (2024 * 12 + 2)  /* 2024-03 */
+#define DENSE_MAX_CELLS (1 << 18)
+#define CHUNK_RECORDS (1 << 14)  /* pedaco de trabalho no modo serial */
+#define CHUNK_BYTES (1 << 20)    /* pedaco de trabalho no modo paralelo */
+#define MAX_NUMA_NODES 64
+#define CACHE_LINE 64
+#define SCB_MAGIC "SENSCOL1"
+#define SCB_VERSION 1
+#define SCB_BYTE_ORDER 0x01020304u
+#define CKP_MAGIC "SENSCKP1"
+#define CKP_VERSION 4
+#define CKP_JANELA (1 << 16)  /* bytes do inicio e do fim conferidos pelo hash */
+
+const char *sensor_names[NUM_SENSORS] = {"temperature", "humidity", "luminosity", "noise", "eco2", "etvoc"};
+
+/* Linha lida com fgets. Os campos que as estatisticas nao usam (id,
+ * contagem, latitude, longitude) nao sao convertidos nem guardados; periodo
+ * e a data ja convertida por parse_line. */
+typedef struct {
+    char device[50];
+    char date[20];
+    int periodo;
+    float temperature;
+    float humidity;
+    float luminosity;
+    float noise;
+    float eco2;
+    float etvoc;
+} SensorData;
+
+/* Registro lido direto do arquivo mapeado: device e data nao sao copiados,
+ * ficam como deslocamento e tamanho dentro do mapeamento. month e o mes da
+ * data (para o filtro e o cache colunar) e periodo, a chave do grupo na
+ * granularidade base. */
+typedef struct {
+    size_t device_off;
+    size_t date_off;
+    unsigned short device_len;
+    unsigned short date_len;
+    int month;
+    int periodo;
+    float temperature;
+    float humidity;
+    float luminosity;
+    float noise;
+    float eco2;
+    float etvoc;
+} SensorRef;
+
+/* Acumuladores de um par (device, periodo) no motor denso. count e comum aos seis
+ * sensores porque toda linha valida traz os seis valores. */
+typedef struct {
+    SensorAcc acc;
+    int count;
+} DenseCell;
+
+/* Bloco denso de uma thread. tocadas lista as celulas usadas no pedaco atual,
+ * na ordem em que foram usadas pela primeira vez. cap e o numero de celulas
+ * alocadas; o bloco so cresce. */
+typedef struct {
+    DenseCell *cells;
+    int *tocadas;
+    int num_tocadas;
+    size_t cap;
+} DenseBlock;
+
+/* Espaco de chaves descoberto na primeira passada do motor denso. */
+typedef struct {
+    DeviceDict devices;
+    int periodo_min;
+    int periodo_max;
+} KeySpace;
+
+/* Metadados de um bloco do cache colunar: intervalo de meses e minimo e
+ * maximo de cada sensor no bloco, para que um filtro possa pular o bloco
+ * inteiro sem ler as colunas. */
+typedef struct {
+    int32_t mes_min;
+    int32_t mes_max;
+    float min[NUM_SENSORS];
+    float max[NUM_SENSORS];
+} ScbBlockMeta;
+
+/* Cabecalho do cache colunar (.scb). O arquivo guarda os registros validos do
+ * CSV (de qualquer mes) como colunas: o id de device e o mes (ano * 12 +
+ * mes - 1) em int32 e um float32 por sensor, na ordem do CSV, mais o
+ * dicionario de devices (nomes terminados em '\0', na ordem dos ids) e um
+ * ScbBlockMeta por bloco de registros_por_bloco registros. Os deslocamentos
+ * contam do inicio do arquivo e sao alinhados a CACHE_LINE; os numeros estao
+ * na ordem de bytes da maquina que gerou o arquivo, conferida por
+ * ordem_bytes. */
+typedef struct {
+    char magic[8];
+    uint32_t versao;
+    uint32_t ordem_bytes;
+    uint64_t num_registros;
+    uint32_t num_devices;
+    uint32_t num_blocos;
+    uint32_t registros_por_bloco;
+    int32_t mes_min;
+    int32_t mes_max;
+    uint32_t reservado;
+    uint64_t off_devices;
+    uint64_t tam_devices;
+    uint64_t off_blocos;
+    uint64_t off_device;
+    uint64_t off_month;
+    uint64_t off_valores[NUM_SENSORS];
+} ScbHeader;
+
+/* Cabecalho do checkpoint do modo incremental: os grupos agregados ate o
+ * byte offset do CSV, o hash dos primeiros CKP_JANELA bytes do arquivo e o
+ * dos CKP_JANELA bytes antes de offset (para perceber um arquivo reescrito em
+ * vez de so crescer, sem reler tudo), o filtro de meses e a granularidade
+ * dos grupos (a base, ver granularity_init). Depois do cabecalho vem o
+ * dicionario de devices (nomes terminados em '\0', na ordem dos ids) e
+ * num_grupos SensorStats, na ordem da tabela. Se tam_sketch nao for zero,
+ * seguem os num_grupos QuantileSketch dos grupos. */
+typedef struct {
+    char magic[8];
+    uint32_t versao;
+    uint32_t ordem_bytes;
+    uint64_t offset;
+    uint32_t hash_inicio;
+    uint32_t hash_fim;
+    uint32_t tam_grupo;
+    uint32_t tam_sketch;
+    int32_t mes_de;
+    int32_t mes_ate;
+    uint32_t num_devices;
+    uint32_t num_grupos;
+    uint64_t tam_devices;
+    uint32_t granularidade;
+    uint32_t reservado;
+} CkpHeader;
+
+/* Registros do modo serial como estrutura de vetores: um vetor de float por
+ * sensor e ids inteiros de device e periodo. Os campos que as estatisticas
+ * nao usam (id, contagem, latitude, longitude) nao sao guardados, entao cada
+ * linha de cache lida pelas threads so traz dados uteis. keys tem o
+ * dicionario de devices e o intervalo de periodos, montados durante a
+ * leitura. Quando as colunas vem do cache colunar, que so e usado na
+ * granularidade mensal (o periodo e o mes), os vetores apontam para o arquivo
+ * mapeado (emprestadas) e blocos tem os metadados de cada pedaco de
+ * CHUNK_RECORDS registros; os meses fora do intervalo de date_filter_init
+ * ainda estao nas colunas e sao descartados na agregacao. */
+typedef struct {
+    float *valores[NUM_SENSORS];
+    int *device;
+    int *periodo;
+    int count;
+    int cap;
+    KeySpace keys;
+    const ScbBlockMeta *blocos;
+    bool emprestadas;
+} RecordColumns;
+
+typedef struct {
+    const char *data;
+    size_t size;
+} MappedFile;
+
+/* Grupos agregados em um pedaco da entrada, na ordem em que apareceram nele.
+ * Os ids de device sao do dicionario de numero origem (a tabela da thread que
+ * processou o pedaco, ou o KeySpace do motor denso). por_parte lista os
+ * indices dos itens agrupados pela parte da fusao a que pertencem: os da
+ * parte p ficam em por_parte[partes[p]] ate por_parte[partes[p + 1] - 1].
+ * Com percentis, sketches[i] e o sketch de itens[i], compactado por
+ * sketch_pack. */
+typedef struct {
+    SensorStats *itens;
+    uint32_t **sketches;
+    int count;
+    int origem;
+    int *partes;
+    int *por_parte;
+} ChunkResult;
+
+/* Trecho contiguo da fila: pedacos de inicio ate fim - 1, dos quais proximo
+ * e o primeiro ainda nao entregue. Cada trecho ocupa sua propria linha de
+ * cache, para que os incrementos em um trecho nao disputem a linha com os
+ * dos outros. */
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_int proximo;
+    int inicio;
+    int fim;
+} ChunkSegment;
+
+/* Fila de pedacos da entrada. limites tem num_chunks + 1 posicoes: indices de
+ * registro no modo serial e deslocamentos no arquivo no paralelo. Cada thread
+ * pega o proximo pedaco livre com um incremento atomico, entao uma thread
+ * lenta ou desescalonada so atrasa o pedaco que esta processando. Os pedacos
+ * ficam em num_trechos trechos contiguos: fora do modo NUMA ha um so trecho;
+ * no modo NUMA ha um por thread, que comeca pelo seu e so depois pega pedacos
+ * dos trechos das outras. O resultado de cada pedaco fica em
+ * resultados[pedaco]. */
+typedef struct {
+    size_t *limites;
+    int num_chunks;
+    int num_partes;
+    ChunkSegment *trechos;
+    int num_trechos;
+    ChunkResult *resultados;
+} ChunkQueue;
+
+/* Posicao de um grupo dentro das tabelas da fusao. parte e guardada somada de
+ * 1, para que a posicao zerada signifique "nenhum grupo". */
+typedef struct {
+    int parte;
+    int item;
+} MergeSlot;
+
+/* Fusao paralela dos resultados dos pedacos da fila. Cada thread e dona de
+ * uma parte das chaves (device, periodo), escolhida pelo hash do nome do
+ * device e do periodo, e mescla na sua tabela parte apenas os grupos dessa
+ * parte. remap[o] traduz os ids do dicionario de origem o para os ids
+ * globais. inicio[c] e a posicao do primeiro grupo do pedaco c na sequencia
+ * de todos os resultados; primeiro marca, nessa sequencia, onde cada grupo
+ * apareceu pela primeira vez. */
+typedef struct {
+    const ChunkQueue *fila;
+    int **remap;
+    size_t *inicio;
+    MergeSlot *primeiro;
+} MergeJob;
+
+/* Fila circular limitada sem trava para varios produtores e consumidores
+ * (algoritmo de Vyukov). Cada posicao tem um numero de sequencia que diz se
+ * ela esta livre para o produtor da volta atual ou cheia para o consumidor;
+ * produtores e consumidores so disputam os contadores cabeca e cauda, cada um
+ * na sua linha de cache. */
+typedef struct {
+    atomic_size_t seq;
+    void *item;
+} RingSlot;
+
+typedef struct {
+    RingSlot *slots;
+    size_t mask;
+    _Alignas(CACHE_LINE) atomic_size_t cabeca;
+    _Alignas(CACHE_LINE) atomic_size_t cauda;
+} Ring;
+
+/* Bloco lido do arquivo no modo pipeline. data tem len bytes terminados em
+ * fim de linha (exceto talvez o ultimo bloco); seq e a posicao do bloco no
+ * arquivo e resultado recebe os grupos do bloco. */
+typedef struct {
+    char *data;
+    size_t len;
+    int seq;
+    ChunkResult resultado;
+} PipeBlock;
+
+/* Filas do modo pipeline: o leitor poe os blocos cheios em trabalho e as
+ * threads devolvem cada bloco agregado em livres, de onde o leitor recolhe o
+ * resultado e reaproveita o buffer. */
+typedef struct {
+    Ring trabalho;
+    Ring livres;
+    int num_partes;
+} Pipeline;
+
+typedef struct WorkerCtx WorkerCtx;
+
+typedef struct {
+    int id;
+    int cpu;
+    SensorEngine *engine;
+    WorkerCtx *ctx;
+    const RecordColumns *cols;
+    const MappedFile *map;
+    ChunkQueue *fila;
+    StatsTable *local_stats;
+    KeySpace *keys;
+    DenseBlock *dense;
+    MergeJob *fusao;
+    Pipeline *pipeline;
+} ThreadArgs;
+
+/* Estado de uma thread do pool: parametros, tabela local, parte da fusao,
+ * bloco denso, espaco de chaves da primeira passada do motor denso e
+ * contadores de progresso. Os contextos ficam em um vetor alinhado e cada um
+ * ocupa linhas de cache proprias, entao as escritas de uma thread no seu
+ * estado nao invalidam as linhas de cache das vizinhas (falso
+ * compartilhamento). arena guarda os resultados dos pedacos que a thread
+ * agregou ate a fusao. Os contadores so sao escritos pela dona, uma vez por
+ * pedaco, e podem ser lidos por outra thread durante a execucao. ocupado e
+ * cpu somam o tempo de parede e de CPU das tarefas da thread na execucao;
+ * sao escritos pela dona ao fim de cada tarefa e lidos depois de
+ * wait_workers. */
+struct WorkerCtx {
+    _Alignas(CACHE_LINE) ThreadArgs args;
+    StatsTable stats;
+    StatsTable parte;
+    DenseBlock dense;
+    KeySpace chaves;
+    Arena arena;
+    _Alignas(CACHE_LINE) atomic_llong pedacos;
+    atomic_llong registros;
+    double ocupado;
+    double cpu;
+};
+
+/* Pool de threads e memoria de trabalho do motor. As threads sao criadas em
+ * engine_create e ficam paradas em tem_tarefa; run_workers publica uma tarefa
+ * incrementando geracao e espera pendentes chegar a zero. As tabelas, as
+ * partes da fusao e os blocos densos das threads sao alocados pela propria
+ * thread, depois de fixada na sua CPU, e sao esvaziados, mas nao liberados,
+ * a cada execucao. */
+struct SensorEngine {
+    int num_threads;
+    bool numa;
+    pthread_t *threads;
+    WorkerCtx *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t tem_tarefa;
+    pthread_cond_t terminou;
+    void *(*tarefa)(void *);
+    unsigned geracao;
+    int pendentes;
+    bool encerrar;
+    EngineTimings tempos;
+    double inicio_tarefa;
+    double em_tarefas;
+};
+
+static double relogio(clockid_t relogio) {
+    struct timespec ts;
+    clock_gettime(relogio, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double agora(void) {
+    return relogio(CLOCK_MONOTONIC);
+}
+
+/* Tempo de CPU do processo, somando todas as threads. */
+static double cpu_agora(void) {
+    return relogio(CLOCK_PROCESS_CPUTIME_ID);
+}
+
+/* Mesmo conjunto de isspace no locale "C", sem consultar o locale. */
+static inline bool is_blank(char c) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+/* Converte o "AAAA-MM" do inicio da data em ano * 12 + (mes - 1), que ordena
+ * os meses como inteiros. Retorna -1 se a data nao comecar nesse formato. */
+int parse_month(const char *date, size_t len) {
+    if (len < 7 || date[4] != '-') return -1;
+    for (int i = 0; i < 7; i++) {
+        if (i != 4 && !isdigit((unsigned char)date[i])) return -1;
+    }
+    int ano = (date[0] - '0') * 1000 + (date[1] - '0') * 100 + (date[2] - '0') * 10 + (date[3] - '0');
+    int mes = (date[5] - '0') * 10 + (date[6] - '0');
+    if (mes < 1 || mes > 12) return -1;
+    return ano * 12 + mes - 1;
+}
+
+/* O filtro de datas, a granularidade e os percentis valem para todos os
+ * motores e tabelas do processo, entao so podem mudar antes que o primeiro
+ * seja criado: uma tabela criada antes de percentiles_init ficaria sem
+ * sketches e uma thread do pool, com a granularidade antiga. */
+static atomic_bool config_fixada = false;
+
+static bool config_aberta(const char *funcao) {
+    if (!atomic_load(&config_fixada)) return true;
+    fprintf(stderr, "Erro: %s chamada depois de engine_create ou stats_table_init\n", funcao);
+    return false;
+}
+
+/* Intervalo de meses aceito por parse_ref e pelos blocos do cache colunar,
+ * inclusivo nas duas pontas. */
+static int filtro_mes_de = FIRST_MONTH;
+static int filtro_mes_ate = INT_MAX;
+
+int date_filter_init(int mes_de, int mes_ate) {
+    if (!config_aberta("date_filter_init")) return -1;
+    filtro_mes_de = mes_de;
+    filtro_mes_ate = mes_ate;
+    return 0;
+}
+
+static inline bool month_in_range(int month) {
+    return month >= filtro_mes_de && month <= filtro_mes_ate;
+}
+
+/* Periodos. Os dias contam de 0000-03-01 no calendario gregoriano
+ * proleptico: toda data a partir dai vira um inteiro nao negativo, o -1 fica
+ * para data invalida e, com o ano comecando em marco, o dia extra dos anos
+ * bissextos cai no fim do ano. 0000-03-01 foi uma quarta-feira, entao a
+ * semana (de segunda a domingo) do dia d e (d + 2) / 7. */
+
+const char *granularity_names[NUM_GRANULARITIES] = {"hour", "day", "week", "month"};
+static const char *periodo_colunas[NUM_GRANULARITIES] = {"hora", "dia", "semana", "ano-mes"};
+
+/* Granularidade das chaves que parse_ref gera e das tabelas novas. */
+static Granularity granularidade_base = GRAN_MONTH;
+
+int granularity_init(const char *lista, Granularity niveis[NUM_GRANULARITIES]) {
+    if (!config_aberta("granularity_init")) return -1;
+    bool pedida[NUM_GRANULARITIES] = {false};
+    const char *p = lista;
+    for (;;) {
+        size_t len = strcspn(p, ",");
+        int g = 0;
+        while (g < NUM_GRANULARITIES &&
+               (strlen(granularity_names[g]) != len || memcmp(p, granularity_names[g], len) != 0)) {
+            g++;
+        }
+        if (g == NUM_GRANULARITIES) return -1;
+        pedida[g] = true;
+        if (p[len] == '\0') break;
+        p += len + 1;
+    }
+
+    int n = 0;
+    for (int g = 0; g < NUM_GRANULARITIES; g++) {
+        if (pedida[g]) niveis[n++] = g;
+    }
+    granularidade_base = niveis[0] == GRAN_WEEK && pedida[GRAN_MONTH] ? GRAN_DAY : niveis[0];
+    return n;
+}
+
+/* Dias de 0000-03-01 ate a data (days_from_civil, de Howard Hinnant). */
+static int dias_de_data(int ano, int mes, int dia) {
+    ano -= mes <= 2;
+    int era = (ano >= 0 ? ano : ano - 399) / 400;
+    int ano_era = ano - era * 400;
+    int dia_ano = (153 * (mes > 2 ? mes - 3 : mes + 9) + 2) / 5 + dia - 1;
+    return era * 146097 + ano_era * 365 + ano_era / 4 - ano_era / 100 + dia_ano;
+}
+
+/* Inverso de dias_de_data. */
+static void data_de_dias(int dias, int *ano, int *mes, int *dia) {
+    int era = (dias >= 0 ? dias : dias - 146096) / 146097;
+    int dia_era = dias - era * 146097;
+    int ano_era = (dia_era - dia_era / 1460 + dia_era / 36524 - dia_era / 146096) / 365;
+    int dia_ano = dia_era - (365 * ano_era + ano_era / 4 - ano_era / 100);
+    int m = (5 * dia_ano + 2) / 153;
+    *dia = dia_ano - (153 * m + 2) / 5 + 1;
+    *mes = m < 10 ? m + 3 : m - 9;
+    *ano = ano_era + era * 400 + (*mes <= 2);
+}
+
+/* Chave na granularidade base da data "AAAA-MM-DD HH...", cujo mes (de
+ * parse_month, valido) ja e conhecido. Retorna -1 se faltar o dia ou a hora
+ * que a granularidade precisa ou se eles forem invalidos. */
+static int parse_periodo(const char *date, size_t len, int month, Granularity base) {
+    static const int dias_mes[12] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (base == GRAN_MONTH) return month;
+    if (len < 10 || date[7] != '-' || !isdigit((unsigned char)date[8]) || !isdigit((unsigned char)date[9])) {
+        return -1;
+    }
+
+    int ano = month / 12, mes = month % 12 + 1;
+    int dia = (date[8] - '0') * 10 + (date[9] - '0');
+    bool bissexto = ano % 4 == 0 && (ano % 100 != 0 || ano % 400 == 0);
+    if (dia < 1 || dia > dias_mes[mes - 1] || (mes == 2 && dia == 29 && !bissexto)) return -1;
+    int dias = dias_de_data(ano, mes, dia);
+    if (dias < 0) return -1;
+    if (base == GRAN_DAY) return dias;
+    if (base == GRAN_WEEK) return (dias + 2) / 7;
+
+    if (len < 13 || (date[10] != ' ' && date[10] != 'T') || !isdigit((unsigned char)date[11]) ||
+        !isdigit((unsigned char)date[12])) {
+        return -1;
+    }
+    int hora = (date[11] - '0') * 10 + (date[12] - '0');
+    if (hora > 23) return -1;
+    return dias * 24 + hora;
+}
+
+/* Converte um periodo da granularidade de para a granularidade para, que deve
+ * ser igual ou mais grossa (e nao mes, se de for semana). */
+static int periodo_converter(int periodo, Granularity de, Granularity para) {
+    if (de == para) return periodo;
+    int dias = de == GRAN_HOUR ? periodo / 24 : periodo;
+    if (para == GRAN_DAY) return dias;
+    if (para == GRAN_WEEK) return (dias + 2) / 7;
+
+    int ano, mes, dia;
+    data_de_dias(dias, &ano, &mes, &dia);
+    return ano * 12 + mes - 1;
+}
+
+/* Periodo como texto: AAAA-MM por mes, AAAA-MM-DD por dia e por semana (a
+ * segunda-feira em que ela comeca) e AAAA-MM-DD HH:00 por hora. */
+static void periodo_texto(char *buf, size_t tam, Granularity g, int periodo) {
+    if (g == GRAN_MONTH) {
+        snprintf(buf, tam, "%04d-%02d", periodo / 12, periodo % 12 + 1);
+        return;
+    }
+    int ano, mes, dia;
+    int dias = g == GRAN_HOUR ? periodo / 24 : g == GRAN_WEEK ? periodo * 7 - 2 : periodo;
+    data_de_dias(dias, &ano, &mes, &dia);
+    if (g == GRAN_HOUR) snprintf(buf, tam, "%04d-%02d-%02d %02d:00", ano, mes, dia, periodo % 24);
+    else snprintf(buf, tam, "%04d-%02d-%02d", ano, mes, dia);
+}
+
+static unsigned string_hash(const char *str, size_t len) {
+    unsigned h = 2166136261u;
+    for (size_t i = 0; i < len; i++) h = (h ^ (unsigned char)str[i]) * 16777619u;
+    return h;
+}
+
+/* Arena: os pedidos saem de blocos de ARENA_BLOCO bytes (ou do tamanho do
+ * pedido, se maior) por incremento de ponteiro, sem cabecalho por pedido e
+ * sem zerar a memoria. Os blocos so sao alocados quando os anteriores
+ * enchem, pela thread que vai usa-los (e, portanto, no no NUMA dela).
+ * arena_reset descarta tudo de uma vez mas mantem os blocos, que sao
+ * reaproveitados na proxima execucao; arena_free devolve os blocos. */
+
+#define ARENA_BLOCO (64 * 1024)
+
+struct ArenaBlock {
+    ArenaBlock *proximo;
+    size_t tam;
+    size_t usado;
+    max_align_t dados[];
+};
+
+static void arena_init(Arena *a) {
+    a->primeiro = NULL;
+    a->atual = NULL;
+}
+
+void *arena_alloc(Arena *a, size_t n) {
+    n = (n + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+
+    // Os blocos depois do atual sobraram de antes do ultimo arena_reset e
+    // estao livres; um bloco pequeno demais para o pedido fica para tras
+    ArenaBlock *b = a->atual;
+    ArenaBlock *ultimo = b;
+    while (b && b->usado + n > b->tam) {
+        ultimo = b;
+        b = b->proximo;
+        if (b) b->usado = 0;
+    }
+
+    if (!b) {
+        size_t tam = n > ARENA_BLOCO ? n : ARENA_BLOCO;
+        b = malloc(sizeof(ArenaBlock) + tam);
+        if (!b) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+        b->proximo = NULL;
+        b->tam = tam;
+        b->usado = 0;
+        if (ultimo) ultimo->proximo = b;
+        else a->primeiro = b;
+    }
+
+    a->atual = b;
+    void *p = (char *)b->dados + b->usado;
+    b->usado += n;
+    return p;
+}
+
+static void arena_reset(Arena *a) {
+    a->atual = a->primeiro;
+    if (a->primeiro) a->primeiro->usado = 0;
+}
+
+static void arena_free(Arena *a) {
+    ArenaBlock *b = a->primeiro;
+    while (b) {
+        ArenaBlock *proximo = b->proximo;
+        free(b);
+        b = proximo;
+    }
+    arena_init(a);
+}
+
+static void device_dict_alloc(DeviceDict *d, int cap) {
+    d->cap = cap;
+    d->indice_cap = cap * 2;
+    d->nomes = realloc(d->nomes, d->cap * sizeof(char *));
+    d->hashes = realloc(d->hashes, d->cap * sizeof(unsigned));
+    free(d->indice);
+    d->indice = malloc(d->indice_cap * sizeof(int));
+    if (!d->nomes || !d->hashes || !d->indice) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    memset(d->indice, -1, d->indice_cap * sizeof(int));
+
+    unsigned mask = d->indice_cap - 1;
+    for (int i = 0; i < d->count; i++) {
+        unsigned pos = d->hashes[i] & mask;
+        while (d->indice[pos] >= 0) pos = (pos + 1) & mask;
+        d->indice[pos] = i;
+    }
+}
+
+static void device_dict_init(DeviceDict *d) {
+    d->nomes = NULL;
+    d->hashes = NULL;
+    d->indice = NULL;
+    d->count = 0;
+    arena_init(&d->arena);
+    device_dict_alloc(d, 64);
+}
+
+static void device_dict_free(DeviceDict *d) {
+    arena_free(&d->arena);
+    free(d->nomes);
+    free(d->hashes);
+    free(d->indice);
+}
+
+/* Remove todos os nomes mantendo os vetores e a arena alocados. */
+static void device_dict_clear(DeviceDict *d) {
+    arena_reset(&d->arena);
+    d->count = 0;
+    memset(d->indice, -1, d->indice_cap * sizeof(int));
+}
+
+/* Retorna o id do device ou -1 se o nome nao estiver no dicionario. */
+static int device_dict_find(const DeviceDict *d, const char *nome, size_t len) {
+    unsigned h = string_hash(nome, len);
+    unsigned mask = d->indice_cap - 1;
+
+    for (unsigned pos = h & mask; d->indice[pos] >= 0; pos = (pos + 1) & mask) {
+        int k = d->indice[pos];
+        if (d->hashes[k] == h && strncmp(d->nomes[k], nome, len) == 0 && d->nomes[k][len] == '\0') {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/* Retorna o id do device, cadastrando o nome se ele ainda nao existir. */
+static int device_dict_intern(DeviceDict *d, const char *nome, size_t len) {
+    unsigned h = string_hash(nome, len);
+    unsigned mask = d->indice_cap - 1;
+    unsigned pos = h & mask;
+
+    while (d->indice[pos] >= 0) {
+        int k = d->indice[pos];
+        if (d->hashes[k] == h && strncmp(d->nomes[k], nome, len) == 0 && d->nomes[k][len] == '\0') {
+            return k;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    if (d->count == d->cap) {
+        device_dict_alloc(d, d->cap * 2);
+        mask = d->indice_cap - 1;
+        pos = h & mask;
+        while (d->indice[pos] >= 0) pos = (pos + 1) & mask;
+    }
+
+    int k = d->count++;
+    d->nomes[k] = arena_alloc(&d->arena, len + 1);
+    memcpy(d->nomes[k], nome, len);
+    d->nomes[k][len] = '\0';
+    d->hashes[k] = h;
+    d->indice[pos] = k;
+    return k;
+}
+
+static unsigned group_hash(int device, int periodo) {
+    unsigned h = (unsigned)device * 0x9E3779B1u ^ (unsigned)periodo * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    return h;
+}
+
+/* Kernels de agregacao. Cada um tem uma versao escalar, uma SSE e uma AVX2;
+ * simd_init escolhe a versao em tempo de execucao conforme a CPU. As tres
+ * aplicam as mesmas operacoes na mesma ordem a cada sensor (min e max com o
+ * mesmo criterio de "v < min ? v : min" e as atualizacoes de Welford linha a
+ * linha, em double e sem FMA), entao os resultados sao identicos bit a bit.
+ *
+ * Cada linha atualiza a media e m2 (soma dos quadrados dos desvios) com o
+ * passo de Welford, usando o inverso do numero de linhas ja vistas:
+ *
+ *   d = x - media;  media += d * (1 / n);  m2 += d * (x - media)
+ *
+ * Isso evita somar milhoes de valores em um unico acumulador, que em float
+ * perdia a precisao da media, e da a variancia (m2 / n) sem o cancelamento de
+ * somar x e x^2 separadamente. */
+
+const char *simd_names[] = {"auto", "scalar", "sse", "avx2"};
+
+/* Acrescenta uma linha (seis valores mais preenchimento) aos acumuladores; n e
+ * o numero de linhas do grupo ja contando esta. */
+static void (*acc_add_row)(SensorAcc *a, const float v[SIMD_LANES], int n);
+/* Mescla os acumuladores p, de nb linhas, em a, de na linhas. */
+static void (*acc_merge)(SensorAcc *a, int na, const SensorAcc *p, int nb);
+/* Acrescenta as linhas [inicio, fim) das colunas aos acumuladores, que ja tem
+ * n linhas. */
+static void (*acc_add_run)(SensorAcc *a, const RecordColumns *cols, int inicio, int fim, int n);
+
+static void acc_init(SensorAcc *a, const float v[SIMD_LANES]) {
+    memcpy(a->min, v, sizeof(a->min));
+    memcpy(a->max, v, sizeof(a->max));
+    for (int j = 0; j < SIMD_LANES; j++) {
+        a->mean[j] = v[j];
+        a->m2[j] = 0;
+    }
+}
+
+/* Variancia populacional do sensor j de um grupo de count linhas. */
+static double acc_variance(const SensorAcc *a, int j, int count) {
+    return a->m2[j] / count;
+}
+
+static void acc_add_row_scalar(SensorAcc *a, const float v[SIMD_LANES], int n) {
+    double r = 1.0 / n;
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        a->min[j] = v[j] < a->min[j] ? v[j] : a->min[j];
+        a->max[j] = v[j] > a->max[j] ? v[j] : a->max[j];
+        double x = v[j];
+        double d = x - a->mean[j];
+        a->mean[j] += d * r;
+        a->m2[j] += d * (x - a->mean[j]);
+    }
+}
+
+/* Combinacao de Chan et al.: com d a diferenca das medias, a media e a media
+ * ponderada e m2 ganha d^2 * na * nb / (na + nb). So depende das duas
+ * parciais, entao a fusao continua sendo uma operacao por grupo. */
+static void acc_merge_scalar(SensorAcc *a, int na, const SensorAcc *p, int nb) {
+    double total = (double)na + nb;
+    double peso = nb / total;
+    double fator = (double)na * nb / total;
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        a->min[j] = p->min[j] < a->min[j] ? p->min[j] : a->min[j];
+        a->max[j] = p->max[j] > a->max[j] ? p->max[j] : a->max[j];
+        double d = p->mean[j] - a->mean[j];
+        a->mean[j] = a->mean[j] + d * peso;
+        a->m2[j] = a->m2[j] + p->m2[j] + d * d * fator;
+    }
+}
+
+/* Versao escalar da reducao de uma sequencia: percorre cada coluna de sensor
+ * separadamente, com os acumuladores em registradores. */
+static void acc_add_run_scalar(SensorAcc *a, const RecordColumns *cols, int inicio, int fim, int n) {
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        const float *v = cols->valores[j];
+        float min = a->min[j];
+        float max = a->max[j];
+        double mean = a->mean[j];
+        double m2 = a->m2[j];
+        for (int i = inicio; i < fim; i++) {
+            min = v[i] < min ? v[i] : min;
+            max = v[i] > max ? v[i] : max;
+            double r = 1.0 / (n + (i - inicio) + 1);
+            double x = v[i];
+            double d = x - mean;
+            mean += d * r;
+            m2 += d * (x - mean);
+        }
+        a->min[j] = min;
+        a->max[j] = max;
+        a->mean[j] = mean;
+        a->m2[j] = m2;
+    }
+}
+
+#ifdef HAVE_X86_SIMD
+/* minps(v, m) devolve m quando a comparacao v < m e falsa (inclusive com NaN),
+ * que e exatamente o criterio da versao escalar; o mesmo vale para maxps. */
+
+/* Passo de Welford para dois sensores em double. */
+static inline __attribute__((target("sse2")))
+void welford_sse(__m128d x, __m128d r, __m128d *mean, __m128d *m2) {
+    __m128d d = _mm_sub_pd(x, *mean);
+    *mean = _mm_add_pd(*mean, _mm_mul_pd(d, r));
+    *m2 = _mm_add_pd(*m2, _mm_mul_pd(d, _mm_sub_pd(x, *mean)));
+}
+
+/* Passo de Welford para quatro sensores (x com os quatro em float) em
+ * media[0..1] e m2[0..1]. */
+static inline __attribute__((target("sse2")))
+void welford4_sse(__m128 x, __m128d r, __m128d *mean, __m128d *m2) {
+    welford_sse(_mm_cvtps_pd(x), r, &mean[0], &m2[0]);
+    welford_sse(_mm_cvtps_pd(_mm_movehl_ps(x, x)), r, &mean[1], &m2[1]);
+}
+
+__attribute__((target("sse2")))
+static void acc_add_row_sse(SensorAcc *a, const float v[SIMD_LANES], int n) {
+    __m128d r = _mm_set1_pd(1.0 / n);
+    for (int k = 0; k < SIMD_LANES; k += 4) {
+        __m128 x = _mm_loadu_ps(v + k);
+        _mm_storeu_ps(a->min + k, _mm_min_ps(x, _mm_loadu_ps(a->min + k)));
+        _mm_storeu_ps(a->max + k, _mm_max_ps(x, _mm_loadu_ps(a->max + k)));
+        __m128d mean[2] = {_mm_loadu_pd(a->mean + k), _mm_loadu_pd(a->mean + k + 2)};
+        __m128d m2[2] = {_mm_loadu_pd(a->m2 + k), _mm_loadu_pd(a->m2 + k + 2)};
+        welford4_sse(x, r, mean, m2);
+        _mm_storeu_pd(a->mean + k, mean[0]);
+        _mm_storeu_pd(a->mean + k + 2, mean[1]);
+        _mm_storeu_pd(a->m2 + k, m2[0]);
+        _mm_storeu_pd(a->m2 + k + 2, m2[1]);
+    }
+}
+
+__attribute__((target("sse2")))
+static void acc_merge_sse(SensorAcc *a, int na, const SensorAcc *p, int nb) {
+    double total = (double)na + nb;
+    __m128d peso = _mm_set1_pd(nb / total);
+    __m128d fator = _mm_set1_pd((double)na * nb / total);
+    for (int k = 0; k < SIMD_LANES; k += 4) {
+        _mm_storeu_ps(a->min + k, _mm_min_ps(_mm_loadu_ps(p->min + k), _mm_loadu_ps(a->min + k)));
+        _mm_storeu_ps(a->max + k, _mm_max_ps(_mm_loadu_ps(p->max + k), _mm_loadu_ps(a->max + k)));
+    }
+    for (int k = 0; k < SIMD_LANES; k += 2) {
+        __m128d mean = _mm_loadu_pd(a->mean + k);
+        __m128d d = _mm_sub_pd(_mm_loadu_pd(p->mean + k), mean);
+        _mm_storeu_pd(a->mean + k, _mm_add_pd(mean, _mm_mul_pd(d, peso)));
+        __m128d m2 = _mm_add_pd(_mm_loadu_pd(a->m2 + k), _mm_loadu_pd(p->m2 + k));
+        _mm_storeu_pd(a->m2 + k, _mm_add_pd(m2, _mm_mul_pd(_mm_mul_pd(d, d), fator)));
+    }
+}
+
+/* Le 4 linhas de cada coluna e transpoe para obter cada linha como vetor de
+ * sensores (0-3 em lo, 4-5 em hi); as linhas sao acumuladas em ordem. */
+__attribute__((target("sse2")))
+static void acc_add_run_sse(SensorAcc *a, const RecordColumns *cols, int inicio, int fim, int n) {
+    __m128 min_lo = _mm_loadu_ps(a->min), min_hi = _mm_loadu_ps(a->min + 4);
+    __m128 max_lo = _mm_loadu_ps(a->max), max_hi = _mm_loadu_ps(a->max + 4);
+    __m128d mean[4], m2[4];
+    for (int k = 0; k < 4; k++) {
+        mean[k] = _mm_loadu_pd(a->mean + 2 * k);
+        m2[k] = _mm_loadu_pd(a->m2 + 2 * k);
+    }
+    float *const *c = cols->valores;
+    int i = inicio;
+
+    for (; i + 4 <= fim; i += 4) {
+        __m128 r0 = _mm_loadu_ps(c[0] + i), r1 = _mm_loadu_ps(c[1] + i);
+        __m128 r2 = _mm_loadu_ps(c[2] + i), r3 = _mm_loadu_ps(c[3] + i);
+        __m128 h0 = _mm_loadu_ps(c[4] + i), h1 = _mm_loadu_ps(c[5] + i);
+        __m128 h2 = _mm_setzero_ps(), h3 = _mm_setzero_ps();
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        _MM_TRANSPOSE4_PS(h0, h1, h2, h3);
+        __m128 lo[4] = {r0, r1, r2, r3};
+        __m128 hi[4] = {h0, h1, h2, h3};
+        for (int k = 0; k < 4; k++) {
+            __m128d r = _mm_set1_pd(1.0 / (n + (i - inicio) + k + 1));
+            min_lo = _mm_min_ps(lo[k], min_lo);
+            max_lo = _mm_max_ps(lo[k], max_lo);
+            welford4_sse(lo[k], r, &mean[0], &m2[0]);
+            min_hi = _mm_min_ps(hi[k], min_hi);
+            max_hi = _mm_max_ps(hi[k], max_hi);
+            welford4_sse(hi[k], r, &mean[2], &m2[2]);
+        }
+    }
+
+    _mm_storeu_ps(a->min, min_lo);
+    _mm_storeu_ps(a->min + 4, min_hi);
+    _mm_storeu_ps(a->max, max_lo);
+    _mm_storeu_ps(a->max + 4, max_hi);
+    for (int k = 0; k < 4; k++) {
+        _mm_storeu_pd(a->mean + 2 * k, mean[k]);
+        _mm_storeu_pd(a->m2 + 2 * k, m2[k]);
+    }
+
+    for (; i < fim; i++) {
+        float v[SIMD_LANES] = {c[0][i], c[1][i], c[2][i], c[3][i], c[4][i], c[5][i]};
+        acc_add_row_sse(a, v, n + (i - inicio) + 1);
+    }
+}
+
+/* Passo de Welford para os oito sensores de x em mean[0..1] e m2[0..1]. */
+static inline __attribute__((target("avx2")))
+void welford_avx2(__m256 x, __m256d r, __m256d *mean, __m256d *m2) {
+    __m256d xs[2] = {_mm256_cvtps_pd(_mm256_castps256_ps128(x)), _mm256_cvtps_pd(_mm256_extractf128_ps(x, 1))};
+    for (int k = 0; k < 2; k++) {
+        __m256d d = _mm256_sub_pd(xs[k], mean[k]);
+        mean[k] = _mm256_add_pd(mean[k], _mm256_mul_pd(d, r));
+        m2[k] = _mm256_add_pd(m2[k], _mm256_mul_pd(d, _mm256_sub_pd(xs[k], mean[k])));
+    }
+}
+
+__attribute__((target("avx2")))
+static void acc_add_row_avx2(SensorAcc *a, const float v[SIMD_LANES], int n) {
+    __m256 x = _mm256_loadu_ps(v);
+    _mm256_storeu_ps(a->min, _mm256_min_ps(x, _mm256_loadu_ps(a->min)));
+    _mm256_storeu_ps(a->max, _mm256_max_ps(x, _mm256_loadu_ps(a->max)));
+    __m256d mean[2] = {_mm256_loadu_pd(a->mean), _mm256_loadu_pd(a->mean + 4)};
+    __m256d m2[2] = {_mm256_loadu_pd(a->m2), _mm256_loadu_pd(a->m2 + 4)};
+    welford_avx2(x, _mm256_set1_pd(1.0 / n), mean, m2);
+    _mm256_storeu_pd(a->mean, mean[0]);
+    _mm256_storeu_pd(a->mean + 4, mean[1]);
+    _mm256_storeu_pd(a->m2, m2[0]);
+    _mm256_storeu_pd(a->m2 + 4, m2[1]);
+}
+
+__attribute__((target("avx2")))
+static void acc_merge_avx2(SensorAcc *a, int na, const SensorAcc *p, int nb) {
+    double total = (double)na + nb;
+    __m256d peso = _mm256_set1_pd(nb / total);
+    __m256d fator = _mm256_set1_pd((double)na * nb / total);
+    _mm256_storeu_ps(a->min, _mm256_min_ps(_mm256_loadu_ps(p->min), _mm256_loadu_ps(a->min)));
+    _mm256_storeu_ps(a->max, _mm256_max_ps(_mm256_loadu_ps(p->max), _mm256_loadu_ps(a->max)));
+    for (int k = 0; k < SIMD_LANES; k += 4) {
+        __m256d mean = _mm256_loadu_pd(a->mean + k);
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(p->mean + k), mean);
+        _mm256_storeu_pd(a->mean + k, _mm256_add_pd(mean, _mm256_mul_pd(d, peso)));
+        __m256d m2 = _mm256_add_pd(_mm256_loadu_pd(a->m2 + k), _mm256_loadu_pd(p->m2 + k));
+        _mm256_storeu_pd(a->m2 + k, _mm256_add_pd(m2, _mm256_mul_pd(_mm256_mul_pd(d, d), fator)));
+    }
+}
+
+/* Le 8 linhas de cada coluna e transpoe o bloco 8x8 (colunas 6 e 7 em zero),
+ * obtendo cada linha como um vetor com os seis sensores. */
+__attribute__((target("avx2")))
+static void acc_add_run_avx2(SensorAcc *a, const RecordColumns *cols, int inicio, int fim, int n) {
+    __m256 min = _mm256_loadu_ps(a->min);
+    __m256 max = _mm256_loadu_ps(a->max);
+    __m256d mean[2] = {_mm256_loadu_pd(a->mean), _mm256_loadu_pd(a->mean + 4)};
+    __m256d m2[2] = {_mm256_loadu_pd(a->m2), _mm256_loadu_pd(a->m2 + 4)};
+    __m256 zero = _mm256_setzero_ps();
+    float *const *c = cols->valores;
+    int i = inicio;
+
+    for (; i + 8 <= fim; i += 8) {
+        __m256 t0 = _mm256_unpacklo_ps(_mm256_loadu_ps(c[0] + i), _mm256_loadu_ps(c[1] + i));
+        __m256 t1 = _mm256_unpackhi_ps(_mm256_loadu_ps(c[0] + i), _mm256_loadu_ps(c[1] + i));
+        __m256 t2 = _mm256_unpacklo_ps(_mm256_loadu_ps(c[2] + i), _mm256_loadu_ps(c[3] + i));
+        __m256 t3 = _mm256_unpackhi_ps(_mm256_loadu_ps(c[2] + i), _mm256_loadu_ps(c[3] + i));
+        __m256 t4 = _mm256_unpacklo_ps(_mm256_loadu_ps(c[4] + i), _mm256_loadu_ps(c[5] + i));
+        __m256 t5 = _mm256_unpackhi_ps(_mm256_loadu_ps(c[4] + i), _mm256_loadu_ps(c[5] + i));
+        __m256 s0 = _mm256_shuffle_ps(t0, t2, 0x44);
+        __m256 s1 = _mm256_shuffle_ps(t0, t2, 0xEE);
+        __m256 s2 = _mm256_shuffle_ps(t1, t3, 0x44);
+        __m256 s3 = _mm256_shuffle_ps(t1, t3, 0xEE);
+        __m256 s4 = _mm256_shuffle_ps(t4, zero, 0x44);
+        __m256 s5 = _mm256_shuffle_ps(t4, zero, 0xEE);
+        __m256 s6 = _mm256_shuffle_ps(t5, zero, 0x44);
+        __m256 s7 = _mm256_shuffle_ps(t5, zero, 0xEE);
+        __m256 linhas[8] = {
+            _mm256_permute2f128_ps(s0, s4, 0x20), _mm256_permute2f128_ps(s1, s5, 0x20),
+            _mm256_permute2f128_ps(s2, s6, 0x20), _mm256_permute2f128_ps(s3, s7, 0x20),
+            _mm256_permute2f128_ps(s0, s4, 0x31), _mm256_permute2f128_ps(s1, s5, 0x31),
+            _mm256_permute2f128_ps(s2, s6, 0x31), _mm256_permute2f128_ps(s3, s7, 0x31)
+        };
+        for (int k = 0; k < 8; k++) {
+            min = _mm256_min_ps(linhas[k], min);
+            max = _mm256_max_ps(linhas[k], max);
+            welford_avx2(linhas[k], _mm256_set1_pd(1.0 / (n + (i - inicio) + k + 1)), mean, m2);
+        }
+    }
+
+    _mm256_storeu_ps(a->min, min);
+    _mm256_storeu_ps(a->max, max);
+    _mm256_storeu_pd(a->mean, mean[0]);
+    _mm256_storeu_pd(a->mean + 4, mean[1]);
+    _mm256_storeu_pd(a->m2, m2[0]);
+    _mm256_storeu_pd(a->m2 + 4, m2[1]);
+
+    for (; i < fim; i++) {
+        float v[SIMD_LANES] = {c[0][i], c[1][i], c[2][i], c[3][i], c[4][i], c[5][i]};
+        acc_add_row_avx2(a, v, n + (i - inicio) + 1);
+    }
+}
+#endif
+
+/* Escolhe os kernels. Com SIMD_AUTO usa o melhor que a CPU suporta; um nivel
+ * pedido e indisponivel cai para o melhor disponivel. Retorna o nivel usado. */
+SimdLevel simd_init(SimdLevel pedido) {
+    SimdLevel melhor = SIMD_SCALAR;
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) melhor = SIMD_SSE;
+    if (__builtin_cpu_supports("avx2")) melhor = SIMD_AVX2;
+#endif
+    SimdLevel nivel = pedido == SIMD_AUTO || pedido > melhor ? melhor : pedido;
+    if (pedido != SIMD_AUTO && nivel != pedido) {
+        fprintf(stderr, "Aviso: %s nao suportado nesta CPU, usando %s\n", simd_names[pedido], simd_names[nivel]);
+    }
+
+    acc_add_row = acc_add_row_scalar;
+    acc_merge = acc_merge_scalar;
+    acc_add_run = acc_add_run_scalar;
+#ifdef HAVE_X86_SIMD
+    if (nivel == SIMD_SSE) {
+        acc_add_row = acc_add_row_sse;
+        acc_merge = acc_merge_sse;
+        acc_add_run = acc_add_run_sse;
+    } else if (nivel == SIMD_AVX2) {
+        acc_add_row = acc_add_row_avx2;
+        acc_merge = acc_merge_avx2;
+        acc_add_run = acc_add_run_avx2;
+    }
+#endif
+    return nivel;
+}
+
+/* Percentis aproximados por grupo e sensor, no esquema do DDSketch: cada
+ * valor cai em um bin de largura relativa fixa e os percentis sao lidos da
+ * contagem acumulada dos bins. O indice do bin sai direto dos bits do float
+ * (expoente e os SKETCH_BITS bits mais altos da mantissa de |v|), como o
+ * BitwiseLinearlyInterpolatedMapping do sketches-java: sem log, e crescente
+ * com |v|. Com 5 bits um bin cobre no maximo 1/32 do seu valor, e o meio do
+ * bin erra no maximo 1/64 (~1,6%) do valor.
+ *
+ * Como no DDSketch, negativos e positivos ficam em colecoes separadas, pelo
+ * valor absoluto, e os zeros em uma contagem propria. Cada colecao guarda so
+ * os SKETCH_BINS bins que terminam no maior indice ja visto nela (topo), o
+ * que cobre 2^(SKETCH_BINS/32) = 256 vezes abaixo do maior valor absoluto M
+ * do mesmo sinal; os menores se juntam no bin mais baixo da janela e saem
+ * como o meio dele, que fica abaixo de M/240. Assim o erro de um percentil e
+ * de no maximo |v|/64 ou M/240, o que for maior. A memoria por grupo e
+ * fixa. Somar dois sketches e somar as contagens depois de alinhar as
+ * janelas, entao a fusao e exata e nao depende da ordem. */
+
+#define SKETCH_BITS 5
+#define SKETCH_VAZIO INT32_MIN
+
+static double percentis[MAX_PERCENTILES];
+static char percentis_nomes[MAX_PERCENTILES][16];
+static int num_percentis = 0;
+
+int percentiles_init(const char *lista) {
+    if (!config_aberta("percentiles_init")) return -1;
+    int n = 0;
+    const char *p = lista;
+    while (*p) {
+        char *fim;
+        double q = strtod(p, &fim);
+        size_t len = fim - p;
+        if (fim == p || !(q >= 0 && q <= 100) || n == MAX_PERCENTILES || len >= sizeof(percentis_nomes[0]) - 1) return -1;
+        percentis[n] = q / 100;
+        snprintf(percentis_nomes[n], sizeof(percentis_nomes[n]), "p%.*s", (int)len, p);
+        n++;
+        p = fim;
+        if (*p == ',') p++;
+        else if (*p) return -1;
+    }
+    num_percentis = n;
+    return n;
+}
+
+/* Indice do bin de |v|. */
+static inline int32_t sketch_key(float v) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    return (int32_t)((bits & 0x7FFFFFFFu) >> (23 - SKETCH_BITS));
+}
+
+/* Valor do meio do bin de indice k. */
+static float sketch_value(int32_t k) {
+    uint32_t lo = (uint32_t)k << (23 - SKETCH_BITS), hi = (uint32_t)(k + 1) << (23 - SKETCH_BITS);
+    float a, b;
+    memcpy(&a, &lo, sizeof(a));
+    memcpy(&b, &hi, sizeof(b));
+    return a + (b - a) / 2;
+}
+
+void sketch_init(QuantileSketch *s) {
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        s->topo[SKETCH_NEG][j] = SKETCH_VAZIO;
+        s->topo[SKETCH_POS][j] = SKETCH_VAZIO;
+    }
+    memset(s->zeros, 0, sizeof(s->zeros));
+    memset(s->bins, 0, sizeof(s->bins));
+}
+
+/* Sobe a janela de uma colecao ate topo (maior que o atual), juntando no
+ * primeiro bin os que saem. */
+static void sketch_shift(uint32_t *bins, int32_t *atual, int32_t topo) {
+    int64_t d = (int64_t)topo - *atual;
+    *atual = topo;
+    if (d >= SKETCH_BINS) {
+        uint32_t total = 0;
+        for (int i = 0; i < SKETCH_BINS; i++) total += bins[i];
+        memset(bins, 0, SKETCH_BINS * sizeof(uint32_t));
+        bins[0] = total;
+        return;
+    }
+    uint32_t baixo = 0;
+    for (int i = 0; i <= d; i++) baixo += bins[i];
+    memmove(bins + 1, bins + d + 1, (SKETCH_BINS - d - 1) * sizeof(uint32_t));
+    memset(bins + SKETCH_BINS - d, 0, d * sizeof(uint32_t));
+    bins[0] = baixo;
+}
+
+/* Soma uma ocorrencia do indice k a colecao (bins, topo). */
+static inline void sketch_add_key(uint32_t *bins, int32_t *topo, int32_t k) {
+    if (*topo == SKETCH_VAZIO) *topo = k;
+    else if (k > *topo) sketch_shift(bins, topo, k);
+    int64_t i = (int64_t)k - *topo + SKETCH_BINS - 1;
+    bins[i < 0 ? 0 : i]++;
+}
+
+/* Soma o valor v ao sensor j; NaN e ignorado. */
+static inline void sketch_add_value(QuantileSketch *s, int j, float v) {
+    if (v > 0) sketch_add_key(s->bins[SKETCH_POS][j], &s->topo[SKETCH_POS][j], sketch_key(v));
+    else if (v < 0) sketch_add_key(s->bins[SKETCH_NEG][j], &s->topo[SKETCH_NEG][j], sketch_key(v));
+    else if (v == 0) s->zeros[j]++;
+}
+
+void sketch_add_row(QuantileSketch *s, const float v[SIMD_LANES]) {
+    for (int j = 0; j < NUM_SENSORS; j++) sketch_add_value(s, j, v[j]);
+}
+
+/* Sobe a janela da colecao (a, topo_a), se preciso, para receber uma de
+ * topo topo_b e retorna d: com as janelas alinhadas no topo, o bin i da
+ * outra e o bin i - d de a, e os de i <= d caem no primeiro bin de a. */
+static int64_t sketch_align(uint32_t *a, int32_t *topo_a, int32_t topo_b) {
+    if (*topo_a == SKETCH_VAZIO) *topo_a = topo_b;
+    else if (topo_b > *topo_a) sketch_shift(a, topo_a, topo_b);
+    return (int64_t)*topo_a - topo_b;
+}
+
+/* Soma a colecao (b, topo_b) a (a, topo_a). */
+static void sketch_merge_store(uint32_t *a, int32_t *topo_a, const uint32_t *b, int32_t topo_b) {
+    if (topo_b == SKETCH_VAZIO) return;
+    int64_t d = sketch_align(a, topo_a, topo_b);
+    if (d >= SKETCH_BINS) d = SKETCH_BINS - 1;
+    for (int i = 0; i <= d; i++) a[0] += b[i];
+    for (int i = d + 1; i < SKETCH_BINS; i++) a[i - d] += b[i];
+}
+
+void sketch_merge(QuantileSketch *a, const QuantileSketch *b) {
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        for (int lado = 0; lado < 2; lado++) {
+            sketch_merge_store(a->bins[lado][j], &a->topo[lado][j], b->bins[lado][j], b->topo[lado][j]);
+        }
+        a->zeros[j] += b->zeros[j];
+    }
+}
+
+/* Um sketch guardado no resultado de um pedaco costuma ter poucos bins nao
+ * vazios, entao vai compactado: as contagens de zeros e, para cada colecao, o
+ * numero k de bins nao vazios seguido, se k > 0, do topo e de k palavras com
+ * o indice do bin nos 8 bits de cima e a contagem nos 24 de baixo (um pedaco
+ * tem bem menos de 2^24 linhas). sketch_pack grava em dst, se nao for NULL, e
+ * retorna o numero de palavras. */
+#define SKETCH_CONTAGEM_BITS 24
+
+static size_t sketch_pack(const QuantileSketch *s, uint32_t *dst) {
+    size_t n = 0;
+    for (int j = 0; j < NUM_SENSORS; j++, n++) {
+        if (dst) dst[n] = s->zeros[j];
+    }
+    for (int lado = 0; lado < 2; lado++) {
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            const uint32_t *bins = s->bins[lado][j];
+            size_t cabecalho = n++;
+            uint32_t k = 0;
+            if (s->topo[lado][j] == SKETCH_VAZIO) {
+                if (dst) dst[cabecalho] = 0;
+                continue;
+            }
+            if (dst) dst[n] = (uint32_t)s->topo[lado][j];
+            n++;
+            for (int i = 0; i < SKETCH_BINS; i++) {
+                if (!bins[i]) continue;
+                if (dst) dst[n] = (uint32_t)i << SKETCH_CONTAGEM_BITS | bins[i];
+                n++;
+                k++;
+            }
+            if (dst) dst[cabecalho] = k;
+        }
+    }
+    return n;
+}
+
+/* Soma a a o sketch compactado p. */
+static void sketch_merge_packed(QuantileSketch *a, const uint32_t *p) {
+    for (int j = 0; j < NUM_SENSORS; j++) a->zeros[j] += *p++;
+    for (int lado = 0; lado < 2; lado++) {
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            uint32_t k = *p++;
+            if (k == 0) continue;
+            uint32_t *bins = a->bins[lado][j];
+            int64_t d = sketch_align(bins, &a->topo[lado][j], (int32_t)*p++);
+            for (; k > 0; k--, p++) {
+                int64_t i = (int64_t)(*p >> SKETCH_CONTAGEM_BITS) - d;
+                bins[i < 0 ? 0 : i] += *p & ((1u << SKETCH_CONTAGEM_BITS) - 1);
+            }
+        }
+    }
+}
+
+/* Valor do percentil q (de 0 a 1) do sensor j: o bin em que a contagem
+ * acumulada passa de q * (n - 1), percorrendo os negativos do maior valor
+ * absoluto para o menor, depois os zeros e os positivos. */
+float sketch_quantile(const QuantileSketch *s, int j, double q) {
+    const uint32_t *neg = s->bins[SKETCH_NEG][j], *pos = s->bins[SKETCH_POS][j];
+    uint64_t n = s->zeros[j];
+    for (int i = 0; i < SKETCH_BINS; i++) n += (uint64_t)neg[i] + pos[i];
+    if (n == 0) return NAN;
+
+    double posto = q * (n - 1);
+    uint64_t acumulado = 0;
+    for (int i = SKETCH_BINS - 1; i >= 0; i--) {
+        acumulado += neg[i];
+        if (acumulado > posto) return -sketch_value(s->topo[SKETCH_NEG][j] - SKETCH_BINS + 1 + i);
+    }
+    acumulado += s->zeros[j];
+    if (acumulado > posto) return 0;
+    int i = 0;
+    for (; i < SKETCH_BINS - 1; i++) {
+        acumulado += pos[i];
+        if (acumulado > posto) break;
+    }
+    return sketch_value(s->topo[SKETCH_POS][j] - SKETCH_BINS + 1 + i);
+}
+
+/* Sketch do grupo g da tabela t, ou NULL sem percentis. */
+static inline QuantileSketch *group_sketch(const StatsTable *t, const SensorStats *g) {
+    return t->sketches ? &t->sketches[g - t->itens] : NULL;
+}
+
+static void stats_table_alloc(StatsTable *t, int cap) {
+    t->cap = cap;
+    t->indice_cap = cap * 2;
+    bool com_sketches = t->sketches != NULL;
+    t->itens = realloc(t->itens, t->cap * sizeof(SensorStats));
+    if (com_sketches) t->sketches = realloc(t->sketches, t->cap * sizeof(QuantileSketch));
+    free(t->indice);
+    t->indice = malloc(t->indice_cap * sizeof(int));
+    if (!t->itens || !t->indice || (com_sketches && !t->sketches)) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    memset(t->indice, -1, t->indice_cap * sizeof(int));
+
+    unsigned mask = t->indice_cap - 1;
+    for (int i = 0; i < t->count; i++) {
+        unsigned pos = group_hash(t->itens[i].device, t->itens[i].periodo) & mask;
+        while (t->indice[pos] >= 0) pos = (pos + 1) & mask;
+        t->indice[pos] = i;
+    }
+}
+
+void stats_table_init(StatsTable *t) {
+    atomic_store(&config_fixada, true);
+    device_dict_init(&t->devices);
+    t->itens = NULL;
+    t->sketches = NULL;
+    t->indice = NULL;
+    t->count = 0;
+    t->granularidade = granularidade_base;
+    stats_table_alloc(t, 256);
+
+    // Daqui em diante os sketches crescem junto com itens em stats_table_alloc
+    if (num_percentis > 0) {
+        t->sketches = malloc(t->cap * sizeof(QuantileSketch));
+        if (!t->sketches) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+void stats_table_free(StatsTable *t) {
+    device_dict_free(&t->devices);
+    free(t->itens);
+    free(t->sketches);
+    free(t->indice);
+}
+
+/* Procura o grupo de (device, periodo). Se nao existir, cria o grupo com essa
+ * chave e *novo fica true; o chamador inicializa os valores (o sketch, se
+ * houver, ja comeca vazio). */
+static SensorStats *stats_table_get(StatsTable *t, int device, int periodo, bool *novo) {
+    unsigned mask = t->indice_cap - 1;
+    unsigned pos = group_hash(device, periodo) & mask;
+
+    while (t->indice[pos] >= 0) {
+        SensorStats *g = &t->itens[t->indice[pos]];
+        if (g->device == device && g->periodo == periodo) {
+            *novo = false;
+            return g;
+        }
+        pos = (pos + 1) & mask;
+    }
+
+    if (t->count == t->cap) {
+        stats_table_alloc(t, t->cap * 2);
+        mask = t->indice_cap - 1;
+        pos = group_hash(device, periodo) & mask;
+        while (t->indice[pos] >= 0) pos = (pos + 1) & mask;
+    }
+
+    int k = t->count++;
+    t->indice[pos] = k;
+    SensorStats *g = &t->itens[k];
+    g->device = device;
+    g->periodo = periodo;
+    if (t->sketches) sketch_init(&t->sketches[k]);
+    *novo = true;
+    return g;
+}
+
+/* Esvazia a tabela mantendo o dicionario de devices e a memoria alocada. */
+static void stats_table_clear(StatsTable *t) {
+    t->count = 0;
+    memset(t->indice, -1, t->indice_cap * sizeof(int));
+}
+
+/* Esvazia a tabela e o dicionario, para reaproveitar a tabela em outra
+ * execucao. */
+static void stats_table_reset(StatsTable *t) {
+    stats_table_clear(t);
+    device_dict_clear(&t->devices);
+}
+
+/* Os grupos de origem sao percorridos na ordem da tabela, entao os de destino
+ * ficam na ordem em que o primeiro periodo fino de cada um apareceu. */
+void stats_table_rollup(const StatsTable *origem, Granularity nivel, StatsTable *destino) {
+    for (int d = 0; d < origem->devices.count; d++) {
+        const char *nome = origem->devices.nomes[d];
+        device_dict_intern(&destino->devices, nome, strlen(nome));
+    }
+    destino->granularidade = nivel;
+
+    for (int i = 0; i < origem->count; i++) {
+        const SensorStats *s = &origem->itens[i];
+        bool novo;
+        SensorStats *g = stats_table_get(destino, s->device, periodo_converter(s->periodo, origem->granularidade, nivel),
+                                         &novo);
+        if (destino->sketches) sketch_merge(group_sketch(destino, g), group_sketch(origem, s));
+        if (novo) {
+            g->acc = s->acc;
+            g->count = s->count;
+            continue;
+        }
+
+        acc_merge(&g->acc, g->count, &s->acc, s->count);
+        g->count += s->count;
+    }
+}
+
+static void aggregate_values(StatsTable *stats, int device, int periodo, const float valores[SIMD_LANES]) {
+    bool novo;
+    SensorStats *g = stats_table_get(stats, device, periodo, &novo);
+    if (stats->sketches) sketch_add_row(group_sketch(stats, g), valores);
+
+    if (novo) {
+        acc_init(&g->acc, valores);
+        g->count = 1;
+        return;
+    }
+
+    g->count++;
+    acc_add_row(&g->acc, valores, g->count);
+}
+
+static void aggregate_record(StatsTable *stats, const SensorData *s) {
+    if (s->periodo < 0) return;
+
+    int device = device_dict_intern(&stats->devices, s->device, strlen(s->device));
+    float valores[SIMD_LANES] = {s->temperature, s->humidity, s->luminosity, s->noise, s->eco2, s->etvoc};
+    aggregate_values(stats, device, s->periodo, valores);
+}
+
+static void aggregate_ref(StatsTable *stats, const char *base, const SensorRef *r) {
+    int device = device_dict_intern(&stats->devices, base + r->device_off, r->device_len);
+    float valores[SIMD_LANES] = {r->temperature, r->humidity, r->luminosity, r->noise, r->eco2, r->etvoc};
+    aggregate_values(stats, device, r->periodo, valores);
+}
+
+/* atof precisa de string terminada em '\0'; o mapeamento e somente leitura,
+ * entao os campos que o caminho rapido nao trata passam por um buffer
+ * pequeno. */
+static float span_atof(const char *p, size_t len) {
+    char buf[64];
+    if (len >= sizeof(buf)) len = sizeof(buf) - 1;
+    memcpy(buf, p, len);
+    buf[len] = '\0';
+    return atof(buf);
+}
+
+static const double pow10_exato[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Converte um campo decimal simples ([+-]digitos[.digitos]) sem passar por
+ * strtod. Se a mantissa cabe em 53 bits e a potencia de 10 e exata em double
+ * (ate 1e22), uma unica divisao da o double corretamente arredondado, o mesmo
+ * que atof devolveria. Qualquer outra forma (expoente, inf, nan, hexadecimal,
+ * lixo no fim, digitos demais) cai em span_atof. */
+static float parse_float(const char *p, size_t len) {
+    const char *s = p;
+    const char *end = p + len;
+    bool neg = false;
+
+    if (s < end && (*s == '-' || *s == '+')) {
+        neg = *s == '-';
+        s++;
+    }
+
+    uint64_t mantissa = 0;
+    int digitos = 0;
+    int casas = 0;
+    bool algum = false;
+    for (; s < end && (unsigned)(*s - '0') < 10; s++) {
+        mantissa = mantissa * 10 + (*s - '0');
+        if (mantissa) digitos++;
+        algum = true;
+    }
+    if (s < end && *s == '.') {
+        for (s++; s < end && (unsigned)(*s - '0') < 10; s++) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa) digitos++;
+            casas++;
+            algum = true;
+        }
+    }
+
+    if (s != end || !algum || digitos > 15 || casas > 22) return span_atof(p, len);
+
+    double valor = (double)mantissa / pow10_exato[casas];
+    return neg ? -valor : valor;
+}
+
+/* Posicao do primeiro '|' ou '\n' em base[pos, limite), ou limite. Compara 8
+ * bytes por vez (SWAR): x ^ repete(c) zera os bytes iguais a c e
+ * (y - 0x01..) & ~y & 0x80.. marca o primeiro byte zero de y. */
+static inline size_t find_delim(const char *base, size_t pos, size_t limite) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    const uint64_t uns = 0x0101010101010101ull;
+    const uint64_t altos = 0x8080808080808080ull;
+    while (pos + 8 <= limite) {
+        uint64_t x;
+        memcpy(&x, base + pos, 8);
+        uint64_t a = x ^ (uns * '|');
+        uint64_t b = x ^ (uns * '\n');
+        uint64_t m = ((a - uns) & ~a & altos) | ((b - uns) & ~b & altos);
+        if (m) return pos + (__builtin_ctzll(m) >> 3);
+        pos += 8;
+    }
+#endif
+    while (pos < limite && base[pos] != '|' && base[pos] != '\n') pos++;
+    return pos;
+}
+
+/* Campos convertidos por parse_ref, um bit por campo: device (1), data (3) e
+ * os seis sensores (4 a 9). id (0), contagem (2), latitude (10) e longitude
+ * (11) nao entram nas estatisticas; sao so contados para validar a linha. */
+#define CAMPOS_CHAVE 0x00Au
+#define CAMPOS_VALORES 0x3FAu
+
+static inline size_t line_end(const char *base, size_t pos, size_t limite) {
+    const char *nl = memchr(base + pos, '\n', limite - pos);
+    return nl ? (size_t)(nl - base) : limite;
+}
+
+/* Tokeniza e converte a linha que comeca em base[inicio], em uma unica
+ * passada, sem copia-la; a linha termina no primeiro '\n' ou em limite, e a
+ * posicao desse fim fica em *fim_linha. Mantem a semantica antiga de strtok +
+ * trim + atof: separadores consecutivos nao geram campo vazio, campos so com
+ * espacos ficam zerados e device/data sao truncados nos mesmos tamanhos de
+ * SensorData. A data e convertida uma vez so, no mes e no periodo da
+ * granularidade dada. Retorna false se a linha nao tiver MAX_FIELDS campos,
+ * se o mes estiver fora de [mes_de, mes_ate] ou se a data nao tiver o dia ou a
+ * hora do periodo. A data e testada assim que e encontrada: uma linha
+ * rejeitada pula direto para o fim, sem converter os sensores. Com
+ * converter = false so device, data e periodo sao preenchidos. */
+static bool parse_ref_range(const char *base, size_t inicio, size_t limite, SensorRef *ref, bool converter,
+                            int mes_de, int mes_ate, Granularity granularidade, size_t *fim_linha) {
+    const unsigned campos = converter ? CAMPOS_VALORES : CAMPOS_CHAVE;
+    int field_count = 0;
+    size_t pos = inicio;
+
+    memset(ref, 0, sizeof(SensorRef));
+    ref->month = -1;
+    ref->periodo = -1;
+
+    for (;;) {
+        while (pos < limite && base[pos] == '|') pos++;
+        if (pos >= limite || base[pos] == '\n') break;
+        if (field_count == MAX_FIELDS) {
+            *fim_linha = line_end(base, pos, limite);
+            return false;
+        }
+
+        size_t ini = pos;
+        size_t end = find_delim(base, pos, limite);
+        pos = end;
+        int i = field_count++;
+        if (!(campos >> i & 1)) continue;
+
+        while (ini < end && is_blank(base[ini])) ini++;
+        while (end > ini && is_blank(base[end - 1])) end--;
+        if (ini == end) continue;
+
+        const char *clean = base + ini;
+        size_t len = end - ini;
+        switch (i) {
+            case 1:
+                ref->device_off = ini;
+                ref->device_len = len < MAX_DEVICE - 1 ? len : MAX_DEVICE - 1;
+                break;
+            case 3:
+                ref->date_off = ini;
+                ref->date_len = len < 19 ? len : 19;
+                ref->month = parse_month(clean, ref->date_len);
+                if (ref->month < mes_de || ref->month > mes_ate) {
+                    *fim_linha = line_end(base, pos, limite);
+                    return false;
+                }
+                ref->periodo = parse_periodo(clean, ref->date_len, ref->month, granularidade);
+                if (ref->periodo < 0) {
+                    *fim_linha = line_end(base, pos, limite);
+                    return false;
+                }
+                break;
+            case 4: ref->temperature = parse_float(clean, len); break;
+            case 5: ref->humidity = parse_float(clean, len); break;
+            case 6: ref->luminosity = parse_float(clean, len); break;
+            case 7: ref->noise = parse_float(clean, len); break;
+            case 8: ref->eco2 = parse_float(clean, len); break;
+            case 9: ref->etvoc = parse_float(clean, len); break;
+        }
+    }
+
+    *fim_linha = pos;
+    return field_count == MAX_FIELDS && ref->month >= mes_de && ref->month <= mes_ate;
+}
+
+/* Aceita qualquer mes valido e so precisa do mes; usada ao gerar o cache
+ * colunar, que guarda todos os meses. */
+static bool parse_ref_any_month(const char *base, size_t inicio, size_t limite, SensorRef *ref, bool converter, size_t *fim_linha) {
+    return parse_ref_range(base, inicio, limite, ref, converter, 0, INT_MAX, GRAN_MONTH, fim_linha);
+}
+
+/* So aceita os meses do intervalo de date_filter_init, com o periodo na
+ * granularidade base. */
+static bool parse_ref(const char *base, size_t inicio, size_t limite, SensorRef *ref, bool converter, size_t *fim_linha) {
+    return parse_ref_range(base, inicio, limite, ref, converter, filtro_mes_de, filtro_mes_ate, granularidade_base,
+                           fim_linha);
+}
+
+/* Converte uma linha lida com fgets em registro, copiando device e data para
+ * dentro de SensorData. Mesmas regras de parse_ref. */
+static bool parse_line(const char *line, SensorData *rec) {
+    SensorRef ref;
+    size_t fim_linha;
+    if (!parse_ref(line, 0, strlen(line), &ref, true, &fim_linha)) return false;
+
+    memset(rec, 0, sizeof(SensorData));
+    memcpy(rec->device, line + ref.device_off, ref.device_len);
+    memcpy(rec->date, line + ref.date_off, ref.date_len);
+    rec->periodo = ref.periodo;
+    rec->temperature = ref.temperature;
+    rec->humidity = ref.humidity;
+    rec->luminosity = ref.luminosity;
+    rec->noise = ref.noise;
+    rec->eco2 = ref.eco2;
+    rec->etvoc = ref.etvoc;
+    return true;
+}
+
+/* Agrega as linhas [inicio, fim) das colunas, que tem todas o mesmo device e
+ * mes: uma busca na tabela e depois uma unica chamada ao kernel de sequencia. */
+static void aggregate_run(StatsTable *stats, const RecordColumns *cols, int inicio, int fim) {
+    bool novo;
+    SensorStats *g = stats_table_get(stats, cols->device[inicio], cols->periodo[inicio], &novo);
+    QuantileSketch *sk = group_sketch(stats, g);
+    for (int i = inicio; sk && i < fim; i++) {
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            sketch_add_value(sk, j, cols->valores[j][i]);
+        }
+    }
+
+    if (novo) {
+        float v[SIMD_LANES] = {0};
+        for (int j = 0; j < NUM_SENSORS; j++) v[j] = cols->valores[j][inicio];
+        acc_init(&g->acc, v);
+        g->count = 1;
+        inicio++;
+    }
+
+    acc_add_run(&g->acc, cols, inicio, fim, g->count);
+    g->count += fim - inicio;
+}
+
+/* Divide os pedacos da fila em num_trechos trechos contiguos de tamanhos
+ * parecidos. */
+static void queue_segment(ChunkQueue *fila, int num_trechos) {
+    fila->num_trechos = num_trechos;
+    fila->trechos = aligned_alloc(CACHE_LINE, num_trechos * sizeof(ChunkSegment));
+    if (!fila->trechos) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    for (int t = 0; t < num_trechos; t++) {
+        fila->trechos[t].inicio = (int)((long long)fila->num_chunks * t / num_trechos);
+        fila->trechos[t].fim = (int)((long long)fila->num_chunks * (t + 1) / num_trechos);
+        atomic_init(&fila->trechos[t].proximo, fila->trechos[t].inicio);
+    }
+}
+
+/* Volta a fila para o primeiro pedaco de cada trecho. */
+static void queue_rewind(ChunkQueue *fila) {
+    for (int t = 0; t < fila->num_trechos; t++) {
+        atomic_store(&fila->trechos[t].proximo, fila->trechos[t].inicio);
+    }
+}
+
+/* Retira o proximo pedaco da fila para a thread id, comecando pelo trecho
+ * dela, e retorna o numero do pedaco, ou -1 quando nao ha mais. */
+static int next_chunk(ChunkQueue *fila, int id, size_t *inicio, size_t *fim) {
+    for (int k = 0; k < fila->num_trechos; k++) {
+        ChunkSegment *trecho = &fila->trechos[(id + k) % fila->num_trechos];
+        if (atomic_load_explicit(&trecho->proximo, memory_order_relaxed) >= trecho->fim) continue;
+        int c = atomic_fetch_add_explicit(&trecho->proximo, 1, memory_order_relaxed);
+        if (c >= trecho->fim) continue;
+        *inicio = fila->limites[c];
+        *fim = fila->limites[c + 1];
+        return c;
+    }
+    return -1;
+}
+
+/* Parte da fusao dona do grupo. Usa o hash do nome, e nao o id, porque os
+ * ids mudam de um dicionario para outro. */
+static inline int merge_part(const DeviceDict *dict, const SensorStats *s, int num_partes) {
+    return group_hash((int)dict->hashes[s->device], s->periodo) % (unsigned)num_partes;
+}
+
+/* Agrupa os indices dos itens de r pela parte da fusao, mantendo a ordem de
+ * aparecimento dentro de cada parte (ordenacao por contagem). */
+static void chunk_partition(ChunkResult *r, const DeviceDict *dict, int num_partes, Arena *arena) {
+    r->partes = arena_alloc(arena, (num_partes + 1 + r->count) * sizeof(int));
+    memset(r->partes, 0, (num_partes + 1) * sizeof(int));
+    r->por_parte = r->partes + num_partes + 1;
+
+    for (int i = 0; i < r->count; i++) r->partes[merge_part(dict, &r->itens[i], num_partes) + 1]++;
+    for (int p = 0; p < num_partes; p++) r->partes[p + 1] += r->partes[p];
+
+    int proximo[num_partes];
+    memcpy(proximo, r->partes, num_partes * sizeof(int));
+    for (int i = 0; i < r->count; i++) r->por_parte[proximo[merge_part(dict, &r->itens[i], num_partes)]++] = i;
+}
+
+/* Conta um pedaco concluido com registros registros. So a dona escreve nos
+ * contadores, entao basta uma leitura e uma escrita relaxadas. */
+static inline void worker_progress(WorkerCtx *ctx, long long registros) {
+    atomic_store_explicit(&ctx->pedacos, atomic_load_explicit(&ctx->pedacos, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&ctx->registros, atomic_load_explicit(&ctx->registros, memory_order_relaxed) + registros, memory_order_relaxed);
+}
+
+/* Guarda os grupos da tabela como resultado de um pedaco, na arena da
+ * thread, e esvazia a tabela para o proximo. */
+static void chunk_flush(ChunkResult *r, StatsTable *stats, int origem, int num_partes, Arena *arena) {
+    r->origem = origem;
+    r->count = stats->count;
+    r->itens = arena_alloc(arena, stats->count * sizeof(SensorStats));
+    memcpy(r->itens, stats->itens, stats->count * sizeof(SensorStats));
+    r->sketches = NULL;
+    if (stats->sketches) {
+        size_t palavras = 0;
+        for (int i = 0; i < stats->count; i++) palavras += sketch_pack(&stats->sketches[i], NULL);
+        uint32_t *dados = arena_alloc(arena, palavras * sizeof(uint32_t));
+        r->sketches = arena_alloc(arena, stats->count * sizeof(uint32_t *));
+        for (int i = 0; i < stats->count; i++) {
+            r->sketches[i] = dados;
+            dados += sketch_pack(&stats->sketches[i], dados);
+        }
+    }
+    chunk_partition(r, &stats->devices, num_partes, arena);
+    stats_table_clear(stats);
+}
+
+/* Confere os meses de um bloco do cache colunar contra o filtro. Se o bloco
+ * todo estiver fora, avanca *inicio ate fim; retorna true se parte dele
+ * estiver fora e cada registro precisar ser testado. */
+static bool block_filter(const ScbBlockMeta *bloco, int *inicio, int fim) {
+    if (bloco->mes_max < filtro_mes_de || bloco->mes_min > filtro_mes_ate) {
+        *inicio = fim;
+        return false;
+    }
+    return bloco->mes_min < filtro_mes_de || bloco->mes_max > filtro_mes_ate;
+}
+
+/* Modo serial (e cache colunar): cada pedaco e uma faixa de registros das
+ * colunas, lida so nos ids e nos seis vetores de sensor. Linhas seguidas do
+ * mesmo device e mes sao agregadas juntas por aggregate_run. */
+static void* thread_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    const RecordColumns *cols = args->cols;
+    StatsTable *stats = args->local_stats;
+    size_t inicio, fim;
+    int c;
+
+    while ((c = next_chunk(args->fila, args->id, &inicio, &fim)) >= 0) {
+        int i = (int)inicio;
+        int end = (int)fim;
+        long long registros = 0;
+        // Com o cache colunar, os metadados do bloco dizem se ha meses a
+        // descartar; um bloco todo fora do intervalo nem e lido
+        bool filtrar = cols->blocos && block_filter(&cols->blocos[c], &i, end);
+        while (i < end) {
+            if (filtrar && !month_in_range(cols->periodo[i])) {
+                i++;
+                continue;
+            }
+            int j = i + 1;
+            while (j < end && cols->device[j] == cols->device[i] && cols->periodo[j] == cols->periodo[i]) j++;
+            aggregate_run(stats, cols, i, j);
+            registros += j - i;
+            i = j;
+        }
+        chunk_flush(&args->fila->resultados[c], stats, args->id, args->fila->num_partes, &args->ctx->arena);
+        worker_progress(args->ctx, registros);
+    }
+
+    return NULL;
+}
+
+/* Converte e agrega as linhas que comecam em [inicio, fim) de base, que tem
+ * size bytes, e retorna quantas eram validas. */
+static long long aggregate_lines(StatsTable *stats, const char *base, size_t inicio, size_t fim, size_t size) {
+    SensorRef ref;
+    long long registros = 0;
+    size_t pos = inicio;
+    while (pos < fim) {
+        size_t fim_linha;
+        if (parse_ref(base, pos, size, &ref, true, &fim_linha)) {
+            aggregate_ref(stats, base, &ref);
+            registros++;
+        }
+        pos = fim_linha + 1;
+    }
+    return registros;
+}
+
+/* Modo paralelo: cada pedaco e uma faixa de bytes do arquivo mapeado; a
+ * thread tokeniza as linhas que comecam dentro dela e agrega direto nas
+ * estatisticas locais, sem copiar as linhas para a heap. */
+static void* mmap_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    const char *base = args->map->data;
+    size_t size = args->map->size;
+    StatsTable *stats = args->local_stats;
+    size_t inicio, fim;
+    int c;
+
+    while ((c = next_chunk(args->fila, args->id, &inicio, &fim)) >= 0) {
+        long long registros = aggregate_lines(stats, base, inicio, fim, size);
+        chunk_flush(&args->fila->resultados[c], stats, args->id, args->fila->num_partes, &args->ctx->arena);
+        worker_progress(args->ctx, registros);
+    }
+
+    return NULL;
+}
+
+static void key_space_init(KeySpace *keys) {
+    device_dict_init(&keys->devices);
+    keys->periodo_min = INT_MAX;
+    keys->periodo_max = INT_MIN;
+}
+
+static void key_space_free(KeySpace *keys) {
+    device_dict_free(&keys->devices);
+}
+
+/* Esvazia o espaco de chaves mantendo a memoria do dicionario. */
+static void key_space_reset(KeySpace *keys) {
+    device_dict_clear(&keys->devices);
+    keys->periodo_min = INT_MAX;
+    keys->periodo_max = INT_MIN;
+}
+
+static void key_space_add(KeySpace *keys, const char *device, size_t device_len, int periodo) {
+    device_dict_intern(&keys->devices, device, device_len);
+    if (periodo < keys->periodo_min) keys->periodo_min = periodo;
+    if (periodo > keys->periodo_max) keys->periodo_max = periodo;
+}
+
+/* Primeira passada do motor denso no modo paralelo: so descobre os devices e
+ * o intervalo de periodos dos pedacos da thread, sem converter os valores. No
+ * modo serial essa informacao ja vem de read_csv. */
+static void* key_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    KeySpace *keys = args->keys;
+    const char *base = args->map->data;
+    size_t size = args->map->size;
+    SensorRef ref;
+    size_t inicio, fim;
+
+    while (next_chunk(args->fila, args->id, &inicio, &fim) >= 0) {
+        size_t pos = inicio;
+        while (pos < fim) {
+            size_t fim_linha;
+            if (parse_ref(base, pos, size, &ref, false, &fim_linha)) {
+                key_space_add(keys, base + ref.device_off, ref.device_len, ref.periodo);
+            }
+            pos = fim_linha + 1;
+        }
+    }
+
+    return NULL;
+}
+
+static void dense_reset(DenseCell *c) {
+    for (int j = 0; j < SIMD_LANES; j++) {
+        c->acc.min[j] = INFINITY;
+        c->acc.max[j] = -INFINITY;
+        c->acc.mean[j] = 0;
+        c->acc.m2[j] = 0;
+    }
+    c->count = 0;
+}
+
+static void dense_add(DenseBlock *b, int c, const float valores[SIMD_LANES]) {
+    DenseCell *cell = &b->cells[c];
+    if (cell->count == 0) b->tocadas[b->num_tocadas++] = c;
+    cell->count++;
+    acc_add_row(&cell->acc, valores, cell->count);
+}
+
+/* Versao densa de chunk_flush: so as celulas tocadas no pedaco viram grupos
+ * do resultado e voltam a ficar vazias. */
+static void dense_flush(ChunkResult *r, DenseBlock *b, const KeySpace *keys, int num_partes, Arena *arena) {
+    int num_periodos = keys->periodo_max - keys->periodo_min + 1;
+    r->origem = 0;
+    r->count = b->num_tocadas;
+    r->sketches = NULL;
+    r->itens = arena_alloc(arena, b->num_tocadas * sizeof(SensorStats));
+    for (int k = 0; k < b->num_tocadas; k++) {
+        int c = b->tocadas[k];
+        SensorStats *g = &r->itens[k];
+        g->acc = b->cells[c].acc;
+        g->count = b->cells[c].count;
+        g->device = c / num_periodos;
+        g->periodo = keys->periodo_min + c % num_periodos;
+        dense_reset(&b->cells[c]);
+    }
+    b->num_tocadas = 0;
+    chunk_partition(r, &keys->devices, num_partes, arena);
+}
+
+/* Segunda passada do motor denso: cada linha vai direto para a celula
+ * [device][periodo] do bloco da thread, sem busca de grupo. No modo serial os ids
+ * ja estao nas colunas; no paralelo o dicionario global so e consultado
+ * quando o device muda em relacao a linha anterior. */
+static void* dense_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    const KeySpace *keys = args->keys;
+    DenseBlock *bloco = args->dense;
+    int num_periodos = keys->periodo_max - keys->periodo_min + 1;
+    size_t num_cells = (size_t)keys->devices.count * num_periodos;
+    size_t inicio, fim;
+    int c;
+
+    // O bloco e alocado e zerado pela propria thread, entao no modo NUMA as
+    // paginas ficam no no dela
+    if (num_cells > bloco->cap) {
+        bloco->cells = realloc(bloco->cells, num_cells * sizeof(DenseCell));
+        bloco->tocadas = realloc(bloco->tocadas, num_cells * sizeof(int));
+        if (!bloco->cells || !bloco->tocadas) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+        bloco->cap = num_cells;
+    }
+    for (size_t k = 0; k < num_cells; k++) dense_reset(&bloco->cells[k]);
+    bloco->num_tocadas = 0;
+
+    if (args->cols) {
+        const RecordColumns *cols = args->cols;
+        while ((c = next_chunk(args->fila, args->id, &inicio, &fim)) >= 0) {
+            long long registros = 0;
+            int ini = (int)inicio;
+            bool filtrar = cols->blocos && block_filter(&cols->blocos[c], &ini, (int)fim);
+            for (size_t i = ini; i < fim; i++) {
+                if (filtrar && !month_in_range(cols->periodo[i])) continue;
+                float valores[SIMD_LANES] = {0};
+                for (int j = 0; j < NUM_SENSORS; j++) valores[j] = cols->valores[j][i];
+                dense_add(bloco, cols->device[i] * num_periodos + cols->periodo[i] - keys->periodo_min, valores);
+                registros++;
+            }
+            dense_flush(&args->fila->resultados[c], bloco, keys, args->fila->num_partes, &args->ctx->arena);
+            worker_progress(args->ctx, registros);
+        }
+        return NULL;
+    }
+
+    const char *ultimo = NULL;
+    size_t ultimo_len = 0;
+    int device = -1;
+
+    const char *base = args->map->data;
+    size_t size = args->map->size;
+    SensorRef ref;
+
+    while ((c = next_chunk(args->fila, args->id, &inicio, &fim)) >= 0) {
+        size_t pos = inicio;
+        long long registros = 0;
+        while (pos < fim) {
+            size_t fim_linha;
+            if (parse_ref(base, pos, size, &ref, true, &fim_linha)) {
+                registros++;
+                const char *nome = base + ref.device_off;
+                if (ref.device_len != ultimo_len || memcmp(nome, ultimo, ref.device_len) != 0) {
+                    device = device_dict_find(&keys->devices, nome, ref.device_len);
+                    ultimo = nome;
+                    ultimo_len = ref.device_len;
+                }
+                float valores[SIMD_LANES] = {ref.temperature, ref.humidity, ref.luminosity, ref.noise, ref.eco2, ref.etvoc};
+                dense_add(bloco, device * num_periodos + ref.periodo - keys->periodo_min, valores);
+            }
+            pos = fim_linha + 1;
+        }
+        dense_flush(&args->fila->resultados[c], bloco, keys, args->fila->num_partes, &args->ctx->arena);
+        worker_progress(args->ctx, registros);
+    }
+
+    return NULL;
+}
+
+/* Mapeia o arquivo inteiro somente para leitura. A leitura e sequencial dentro
+ * de cada faixa, entao o kernel pode adiantar paginas e descartar as lidas. */
+static int map_csv(const char *filename, MappedFile *map) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Erro ao abrir arquivo");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "Erro: '%s' nao e um arquivo regular\n", filename);
+        close(fd);
+        return -1;
+    }
+
+    map->data = NULL;
+    map->size = st.st_size;
+    if (map->size > 0) {
+        void *p = mmap(NULL, map->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p == MAP_FAILED) {
+            perror("Erro ao mapear arquivo");
+            close(fd);
+            return -1;
+        }
+        madvise(p, map->size, MADV_SEQUENTIAL);
+        map->data = p;
+    }
+
+    close(fd);
+    return 0;
+}
+
+static void unmap_csv(MappedFile *map) {
+    if (map->data) munmap((void *)map->data, map->size);
+    map->data = NULL;
+}
+
+/* Divide os bytes [inicio, fim) do arquivo em num_ranges faixas. inicio deve
+ * ser o inicio de uma linha. Cada limite interno e empurrado para o inicio da
+ * linha seguinte, de modo que nenhuma linha fique dividida entre duas faixas.
+ * limites deve ter num_ranges + 1 posicoes. */
+static void split_ranges(const MappedFile *map, size_t inicio, size_t fim, int num_ranges, size_t *limites) {
+    limites[0] = inicio;
+    for (int i = 1; i < num_ranges; i++) {
+        size_t pos = inicio + (fim - inicio) / num_ranges * i;
+        if (pos <= limites[i - 1]) pos = limites[i - 1];
+
+        if (pos > inicio && pos < fim) {
+            const char *nl = memchr(map->data + pos - 1, '\n', fim - pos + 1);
+            pos = nl ? (size_t)(nl - map->data) + 1 : fim;
+        }
+        limites[i] = pos;
+    }
+    limites[num_ranges] = fim;
+}
+
+void salvar_csv(const StatsTable *stats, const char *nome_arquivo) {
+    FILE *fp = fopen(nome_arquivo, "w");
+    if (!fp) {
+        perror("Erro ao criar arquivo de saida");
+        return;
+    }
+
+    fprintf(fp, "device;%s;sensor;valor_maximo;valor_medio;valor_minimo;variancia;desvio_padrao",
+            periodo_colunas[stats->granularidade]);
+    for (int k = 0; stats->sketches && k < num_percentis; k++) fprintf(fp, ";%s", percentis_nomes[k]);
+    fprintf(fp, "\n");
+    for (int i = 0; i < stats->count; i++) {
+        SensorStats *g = &stats->itens[i];
+        const QuantileSketch *sk = group_sketch(stats, g);
+        char periodo[24];
+        periodo_texto(periodo, sizeof(periodo), stats->granularidade, g->periodo);
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            double variancia = acc_variance(&g->acc, j, g->count);
+            fprintf(fp, "%s;%s;%s;%.2f;%.2f;%.2f;%.2f;%.2f", stats->devices.nomes[g->device], periodo, sensor_names[j],
+                    g->acc.max[j], g->acc.mean[j], g->acc.min[j], variancia, sqrt(variancia));
+            for (int k = 0; sk && k < num_percentis; k++) fprintf(fp, ";%.2f", sketch_quantile(sk, j, percentis[k]));
+            fprintf(fp, "\n");
+        }
+    }
+
+    fclose(fp);
+    printf("\nArquivo de resultados salvo como '%s'\n", nome_arquivo);
+}
+
+/* "-" le da entrada padrao, permitindo usar o programa no fim de um pipe. */
+static FILE *open_input(const char *filename) {
+    if (strcmp(filename, "-") == 0) return stdin;
+    FILE *file = fopen(filename, "r");
+    if (!file) perror("Erro ao abrir arquivo");
+    return file;
+}
+
+static void close_input(FILE *file) {
+    if (file != stdin) fclose(file);
+}
+
+bool is_regular_file(const char *filename) {
+    struct stat st;
+    return strcmp(filename, "-") != 0 && stat(filename, &st) == 0 && S_ISREG(st.st_mode);
+}
+
+static void records_init(RecordColumns *cols) {
+    for (int j = 0; j < NUM_SENSORS; j++) cols->valores[j] = NULL;
+    cols->device = NULL;
+    cols->periodo = NULL;
+    cols->count = 0;
+    cols->cap = 0;
+    key_space_init(&cols->keys);
+    cols->blocos = NULL;
+    cols->emprestadas = false;
+}
+
+static void records_free(RecordColumns *cols) {
+    if (!cols->emprestadas) {
+        for (int j = 0; j < NUM_SENSORS; j++) free(cols->valores[j]);
+        free(cols->device);
+        free(cols->periodo);
+    }
+    key_space_free(&cols->keys);
+}
+
+/* Garante espaco para cap registros nas colunas. */
+static void records_reserve(RecordColumns *cols, int cap) {
+    if (cap <= cols->cap) return;
+    cols->cap = cap;
+    for (int j = 0; j < NUM_SENSORS; j++) {
+        cols->valores[j] = realloc(cols->valores[j], cols->cap * sizeof(float));
+        if (!cols->valores[j]) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+    }
+    cols->device = realloc(cols->device, cols->cap * sizeof(int));
+    cols->periodo = realloc(cols->periodo, cols->cap * sizeof(int));
+    if (!cols->device || !cols->periodo) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Acrescenta um registro as colunas, dobrando a capacidade quando enche, de
+ * modo que o custo de copia por registro e constante em media. */
+static void records_push(RecordColumns *cols, const char *device, size_t device_len, int periodo, const float valores[NUM_SENSORS]) {
+    if (cols->count == cols->cap) {
+        // Os indices das colunas sao int: passar disso exige o modo parallel ou
+        // stream, que nao guardam os registros
+        if (cols->cap == INT_MAX) {
+            fprintf(stderr, "Erro: mais de %d registros nas colunas; use o modo parallel ou stream\n", INT_MAX);
+            exit(EXIT_FAILURE);
+        }
+        records_reserve(cols, cols->cap == 0 ? 4096 : cols->cap < INT_MAX / 2 ? cols->cap * 2 : INT_MAX);
+    }
+
+    int i = cols->count++;
+    cols->device[i] = device_dict_intern(&cols->keys.devices, device, device_len);
+    cols->periodo[i] = periodo;
+    if (periodo < cols->keys.periodo_min) cols->keys.periodo_min = periodo;
+    if (periodo > cols->keys.periodo_max) cols->keys.periodo_max = periodo;
+    for (int j = 0; j < NUM_SENSORS; j++) cols->valores[j][i] = valores[j];
+}
+
+static void records_append(RecordColumns *cols, const SensorData *s) {
+    float valores[NUM_SENSORS] = {s->temperature, s->humidity, s->luminosity, s->noise, s->eco2, s->etvoc};
+    records_push(cols, s->device, strlen(s->device), s->periodo, valores);
+}
+
+/* Estima o numero de linhas de um arquivo regular pelo tamanho dele e pelo
+ * comprimento medio das linhas do primeiro bloco, e volta o arquivo para o
+ * inicio. Retorna 0 se nao der para estimar (pipe, arquivo vazio). */
+static size_t estimate_lines(FILE *file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0) return 0;
+
+    char amostra[1 << 16];
+    size_t lidos = fread(amostra, 1, sizeof(amostra), file);
+    rewind(file);
+
+    size_t linhas = 0;
+    for (size_t i = 0; i < lidos; i++) {
+        if (amostra[i] == '\n') linhas++;
+    }
+    if (linhas == 0) return 1;
+    return (size_t)st.st_size / (lidos / linhas) + 1;
+}
+
+/* Le os registros validos de filename para as colunas (em cols->count).
+ * Retorna -1 se a entrada nao puder ser aberta. */
+static int read_csv(const char *filename, RecordColumns *cols) {
+    FILE *file = open_input(filename);
+    if (!file) return -1;
+
+    // Reserva as colunas de uma vez; o crescimento geometrico so entra em
+    // acao se a estimativa ficar curta
+    size_t estimativa = estimate_lines(file);
+    if (estimativa > 0) records_reserve(cols, estimativa < INT_MAX ? (int)estimativa : INT_MAX);
+
+    char line[MAX_LINE_LENGTH];
+    SensorData rec;
+
+    while (fgets(line, sizeof(line), file)) {
+        if (parse_line(line, &rec)) {
+            records_append(cols, &rec);
+        }
+    }
+
+    close_input(file);
+    return 0;
+}
+
+/* Modo stream: cada linha e convertida e agregada assim que lida, sem guardar
+ * o vetor de registros. A memoria usada depende so do numero de grupos, entao
+ * a entrada pode ser ilimitada ou vir de um pipe; a contagem de registros vai
+ * para *registros. Retorna -1 se a entrada nao puder ser aberta. */
+static int stream_csv(const char *filename, StatsTable *stats, long long *registros) {
+    *registros = 0;
+    FILE *file = open_input(filename);
+    if (!file) return -1;
+
+    char line[MAX_LINE_LENGTH];
+    SensorData rec;
+    long long record_count = 0;
+
+    while (fgets(line, sizeof(line), file)) {
+        if (parse_line(line, &rec)) {
+            aggregate_record(stats, &rec);
+            record_count++;
+        }
+    }
+
+    close_input(file);
+    *registros = record_count;
+    return 0;
+}
+
+/* Le uma lista de CPUs no formato do kernel ("0-3,8,10-11") para *cpus, na
+ * ordem da lista. Retorna o numero de CPUs, ou -1 se a lista for invalida. */
+int parse_cpu_list(const char *lista, int **cpus) {
+    int cap = 16;
+    int n = 0;
+    int *v = malloc(cap * sizeof(int));
+    if (!v) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *p = lista;
+    bool valida = true;
+    while (valida && *p && *p != '\n') {
+        char *fim;
+        long a = strtol(p, &fim, 10);
+        long b = a;
+        if (fim == p || a < 0) {
+            valida = false;
+            break;
+        }
+        p = fim;
+        if (*p == '-') {
+            b = strtol(p + 1, &fim, 10);
+            if (fim == p + 1 || b < a) valida = false;
+            p = fim;
+        }
+        if (b >= CPU_SETSIZE) valida = false;
+
+        for (long c = a; valida && c <= b; c++) {
+            if (n == cap) {
+                cap *= 2;
+                v = realloc(v, cap * sizeof(int));
+                if (!v) {
+                    perror("Erro de alocacao");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            v[n++] = (int)c;
+        }
+        if (*p == ',') p++;
+        else if (*p && *p != '\n') valida = false;
+    }
+
+    if (!valida || n == 0) {
+        free(v);
+        return -1;
+    }
+    *cpus = v;
+    return n;
+}
+
+/* Preenche no[cpu] com o no NUMA de cada CPU (-1 se desconhecido) e retorna o
+ * maior no encontrado. Usa libnuma quando o programa e compilado com
+ * -DHAVE_LIBNUMA e o kernel suporta NUMA; senao le as listas de CPUs de
+ * /sys/devices/system/node. */
+static int numa_topology(int no[CPU_SETSIZE]) {
+    int max_no = 0;
+    for (int c = 0; c < CPU_SETSIZE; c++) no[c] = -1;
+
+#ifdef HAVE_LIBNUMA
+    if (numa_available() >= 0) {
+        int num_cpus = numa_num_configured_cpus();
+        for (int c = 0; c < num_cpus && c < CPU_SETSIZE; c++) {
+            no[c] = numa_node_of_cpu(c);
+            if (no[c] > max_no) max_no = no[c];
+        }
+        return max_no;
+    }
+#endif
+
+    for (int n = 0; n < MAX_NUMA_NODES; n++) {
+        char caminho[64];
+        char lista[4096];
+        snprintf(caminho, sizeof(caminho), "/sys/devices/system/node/node%d/cpulist", n);
+        FILE *f = fopen(caminho, "r");
+        if (!f) continue;
+        if (fgets(lista, sizeof(lista), f)) {
+            int *cpus;
+            int num_cpus = parse_cpu_list(lista, &cpus);
+            for (int i = 0; i < num_cpus; i++) no[cpus[i]] = n;
+            if (num_cpus > 0) {
+                free(cpus);
+                max_no = n;
+            }
+        }
+        fclose(f);
+    }
+    return max_no;
+}
+
+int numa_cpus(int **cpus) {
+    cpu_set_t permitidas;
+    if (sched_getaffinity(0, sizeof(permitidas), &permitidas) != 0) return -1;
+
+    int no[CPU_SETSIZE];
+    int max_no = numa_topology(no);
+    int *v = malloc((CPU_COUNT(&permitidas) + 1) * sizeof(int));
+    if (!v) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+
+    // Um no de cada vez; CPUs de no desconhecido ficam no fim
+    int n = 0;
+    for (int k = 0; k <= max_no + 1; k++) {
+        int alvo = k <= max_no ? k : -1;
+        for (int c = 0; c < CPU_SETSIZE; c++) {
+            if (CPU_ISSET(c, &permitidas) && no[c] == alvo) v[n++] = c;
+        }
+    }
+    *cpus = v;
+    return n;
+}
+
+/* Laco das threads do pool. A thread se fixa na sua CPU e aloca as proprias
+ * tabelas antes de tudo, para que a memoria delas fique no seu no NUMA
+ * (primeiro toque); depois espera uma tarefa nova (geracao diferente da
+ * ultima vista), executa sobre os proprios ThreadArgs e avisa quando acaba. */
+static void *pool_loop(void *arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+    SensorEngine *e = args->engine;
+    unsigned vista = 0;
+
+    if (args->cpu >= 0) {
+        cpu_set_t conjunto;
+        CPU_ZERO(&conjunto);
+        CPU_SET(args->cpu, &conjunto);
+        int erro = pthread_setaffinity_np(pthread_self(), sizeof(conjunto), &conjunto);
+        if (erro != 0) {
+            fprintf(stderr, "Nao foi possivel fixar a thread %d na CPU %d: %s\n", args->id, args->cpu, strerror(erro));
+            // A thread segue sem fixar; engine_thread_stats informa isso
+            args->cpu = -1;
+        }
+    }
+    stats_table_init(&args->ctx->stats);
+    stats_table_init(&args->ctx->parte);
+    key_space_init(&args->ctx->chaves);
+    arena_init(&args->ctx->arena);
+
+    pthread_mutex_lock(&e->lock);
+    if (--e->pendentes == 0) pthread_cond_signal(&e->terminou);
+    for (;;) {
+        while (!e->encerrar && e->geracao == vista) pthread_cond_wait(&e->tem_tarefa, &e->lock);
+        if (e->encerrar) break;
+        vista = e->geracao;
+        void *(*tarefa)(void *) = e->tarefa;
+        pthread_mutex_unlock(&e->lock);
+
+        double inicio = agora();
+        double inicio_cpu = relogio(CLOCK_THREAD_CPUTIME_ID);
+        tarefa(args);
+        args->ctx->ocupado += agora() - inicio;
+        args->ctx->cpu += relogio(CLOCK_THREAD_CPUTIME_ID) - inicio_cpu;
+
+        pthread_mutex_lock(&e->lock);
+        if (--e->pendentes == 0) pthread_cond_signal(&e->terminou);
+    }
+    pthread_mutex_unlock(&e->lock);
+    return NULL;
+}
+
+/* Publica worker para todas as threads do pool, sobre a fila de pedacos de
+ * e->args, se houver, que volta ao inicio a cada chamada. Retorna sem
+ * esperar. */
+static void start_workers(SensorEngine *e, void *(*worker)(void *)) {
+    if (e->ctx[0].args.fila) queue_rewind(e->ctx[0].args.fila);
+    pthread_mutex_lock(&e->lock);
+    e->inicio_tarefa = agora();
+    e->tarefa = worker;
+    e->pendentes = e->num_threads;
+    e->geracao++;
+    pthread_cond_broadcast(&e->tem_tarefa);
+    pthread_mutex_unlock(&e->lock);
+}
+
+/* Espera todas as threads terminarem a tarefa publicada por start_workers. */
+static void wait_workers(SensorEngine *e) {
+    pthread_mutex_lock(&e->lock);
+    while (e->pendentes > 0) pthread_cond_wait(&e->terminou, &e->lock);
+    e->em_tarefas += agora() - e->inicio_tarefa;
+    pthread_mutex_unlock(&e->lock);
+}
+
+/* Executa worker em todas as threads do pool e espera todas terminarem. */
+static void run_workers(SensorEngine *e, void *(*worker)(void *)) {
+    start_workers(e, worker);
+    wait_workers(e);
+}
+
+/* Fusao da parte args->id: percorre os pedacos em ordem, mas so os itens da
+ * propria parte, entao as parciais de cada grupo sao somadas na ordem dos
+ * pedacos, como na fusao sequencial. */
+static void* merge_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    MergeJob *job = args->fusao;
+    const ChunkQueue *fila = job->fila;
+    StatsTable *parte = &args->ctx->parte;
+
+    stats_table_clear(parte);
+    for (int c = 0; c < fila->num_chunks; c++) {
+        const ChunkResult *r = &fila->resultados[c];
+        const int *remap = job->remap[r->origem];
+        for (int j = r->partes[args->id]; j < r->partes[args->id + 1]; j++) {
+            int i = r->por_parte[j];
+            const SensorStats *s = &r->itens[i];
+            bool novo;
+            SensorStats *g = stats_table_get(parte, remap[s->device], s->periodo, &novo);
+            if (r->sketches) sketch_merge_packed(group_sketch(parte, g), r->sketches[i]);
+            if (novo) {
+                g->acc = s->acc;
+                g->count = s->count;
+                job->primeiro[job->inicio[c] + i] = (MergeSlot){args->id + 1, (int)(g - parte->itens)};
+                continue;
+            }
+
+            acc_merge(&g->acc, g->count, &s->acc, s->count);
+            g->count += s->count;
+        }
+    }
+
+    return NULL;
+}
+
+/* Mescla os resultados dos pedacos em merged. Cada thread do pool funde as
+ * chaves da sua parte (merge_worker), entao o tempo da fusao cai com o numero
+ * de threads. Depois os grupos sao copiados para merged na ordem em que
+ * apareceram pela primeira vez nos pedacos, que e a ordem do arquivo; o
+ * resultado e o mesmo da fusao sequencial, qualquer que seja o numero de
+ * threads ou a thread que pegou cada pedaco. dicts[o] e o dicionario dos ids
+ * de origem o. */
+static void merge_chunks(SensorEngine *e, ChunkQueue *fila, const DeviceDict *const *dicts, int num_dicts, StatsTable *merged) {
+    double inicio_fusao = agora();
+    double inicio_fusao_cpu = cpu_agora();
+    int *remap[num_dicts];
+    for (int o = 0; o < num_dicts; o++) {
+        remap[o] = malloc((dicts[o]->count + 1) * sizeof(int));
+        if (!remap[o]) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < dicts[o]->count; i++) {
+            const char *nome = dicts[o]->nomes[i];
+            remap[o][i] = device_dict_intern(&merged->devices, nome, strlen(nome));
+        }
+    }
+
+    MergeJob job = {fila, remap, NULL, NULL};
+    job.inicio = malloc((fila->num_chunks + 1) * sizeof(size_t));
+    if (!job.inicio) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    job.inicio[0] = 0;
+    for (int c = 0; c < fila->num_chunks; c++) job.inicio[c + 1] = job.inicio[c] + fila->resultados[c].count;
+    size_t total = job.inicio[fila->num_chunks];
+    job.primeiro = calloc(total + 1, sizeof(MergeSlot));
+    if (!job.primeiro) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < e->num_threads; i++) e->ctx[i].args.fusao = &job;
+    run_workers(e, merge_worker);
+
+    for (size_t k = 0; k < total; k++) {
+        MergeSlot slot = job.primeiro[k];
+        if (slot.parte == 0) continue;
+        const StatsTable *parte = &e->ctx[slot.parte - 1].parte;
+        const SensorStats *s = &parte->itens[slot.item];
+        bool novo;
+        SensorStats *g = stats_table_get(merged, s->device, s->periodo, &novo);
+        if (merged->sketches) sketch_merge(group_sketch(merged, g), group_sketch(parte, s));
+        if (novo) {
+            g->acc = s->acc;
+            g->count = s->count;
+            continue;
+        }
+
+        acc_merge(&g->acc, g->count, &s->acc, s->count);
+        g->count += s->count;
+    }
+
+    // Os resultados ficam nas arenas das threads e sao descartados de uma vez
+    for (int c = 0; c < fila->num_chunks; c++) {
+        ChunkResult *r = &fila->resultados[c];
+        r->itens = NULL;
+        r->sketches = NULL;
+        r->partes = NULL;
+        r->count = 0;
+    }
+    for (int i = 0; i < e->num_threads; i++) arena_reset(&e->ctx[i].arena);
+    free(job.primeiro);
+    free(job.inicio);
+    for (int o = 0; o < num_dicts; o++) free(remap[o]);
+    e->tempos.fusao += agora() - inicio_fusao;
+    e->tempos.fusao_cpu += cpu_agora() - inicio_fusao_cpu;
+}
+
+SensorEngine *engine_create(int num_threads) {
+    EngineConfig cfg = {num_threads, NULL, 0, false};
+    return engine_create_config(&cfg);
+}
+
+SensorEngine *engine_create_config(const EngineConfig *cfg) {
+    int num_threads = cfg->num_threads;
+    if (num_threads < 1) num_threads = 1;
+    if (!acc_add_row) simd_init(SIMD_AUTO);
+    atomic_store(&config_fixada, true);
+
+    SensorEngine *e = calloc(1, sizeof(SensorEngine));
+    if (!e) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    e->num_threads = num_threads;
+    e->numa = cfg->numa;
+    e->threads = malloc(num_threads * sizeof(pthread_t));
+    e->ctx = aligned_alloc(CACHE_LINE, num_threads * sizeof(WorkerCtx));
+    if (!e->threads || !e->ctx) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    memset(e->ctx, 0, num_threads * sizeof(WorkerCtx));
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->tem_tarefa, NULL);
+    pthread_cond_init(&e->terminou, NULL);
+
+    // pendentes conta as threads que ainda nao alocaram suas tabelas
+    e->pendentes = num_threads;
+    for (int i = 0; i < num_threads; i++) {
+        ThreadArgs *args = &e->ctx[i].args;
+        args->id = i;
+        args->cpu = cfg->cpus && cfg->num_cpus > 0 ? cfg->cpus[i % cfg->num_cpus] : -1;
+        args->engine = e;
+        args->ctx = &e->ctx[i];
+        if (pthread_create(&e->threads[i], NULL, pool_loop, args) != 0) {
+            perror("Erro ao criar thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_lock(&e->lock);
+    while (e->pendentes > 0) pthread_cond_wait(&e->terminou, &e->lock);
+    pthread_mutex_unlock(&e->lock);
+    return e;
+}
+
+void engine_timings(SensorEngine *e, EngineTimings *t) {
+    *t = e->tempos;
+}
+
+int engine_num_threads(SensorEngine *e) {
+    return e->num_threads;
+}
+
+void engine_thread_stats(SensorEngine *e, int i, ThreadStats *s) {
+    const WorkerCtx *ctx = &e->ctx[i];
+    s->cpu_fixada = ctx->args.cpu;
+    s->pedacos = atomic_load_explicit(&ctx->pedacos, memory_order_relaxed);
+    s->registros = atomic_load_explicit(&ctx->registros, memory_order_relaxed);
+    s->ocupado = ctx->ocupado;
+    s->cpu = ctx->cpu;
+    s->ocioso = e->em_tarefas - ctx->ocupado;
+}
+
+void engine_progress(SensorEngine *e, long long *pedacos, long long *registros) {
+    *pedacos = 0;
+    *registros = 0;
+    for (int i = 0; i < e->num_threads; i++) {
+        *pedacos += atomic_load_explicit(&e->ctx[i].pedacos, memory_order_relaxed);
+        *registros += atomic_load_explicit(&e->ctx[i].registros, memory_order_relaxed);
+    }
+}
+
+void engine_destroy(SensorEngine *e) {
+    pthread_mutex_lock(&e->lock);
+    e->encerrar = true;
+    pthread_cond_broadcast(&e->tem_tarefa);
+    pthread_mutex_unlock(&e->lock);
+
+    for (int i = 0; i < e->num_threads; i++) {
+        pthread_join(e->threads[i], NULL);
+        stats_table_free(&e->ctx[i].stats);
+        stats_table_free(&e->ctx[i].parte);
+        key_space_free(&e->ctx[i].chaves);
+        arena_free(&e->ctx[i].arena);
+        free(e->ctx[i].dense.cells);
+        free(e->ctx[i].dense.tocadas);
+    }
+    pthread_mutex_destroy(&e->lock);
+    pthread_cond_destroy(&e->tem_tarefa);
+    pthread_cond_destroy(&e->terminou);
+    free(e->threads);
+    free(e->ctx);
+    free(e);
+}
+
+/* Motor denso: uma passada descobre devices e periodos, outra agrega cada
+ * pedaco em blocos [device][periodo] por thread. Retorna -1, sem agregar nada, se o
+ * espaco de chaves for grande demais ou se houver percentis (um sketch por
+ * celula ocuparia memoria demais); nesse caso o chamador usa o motor hash. */
+static int run_dense(SensorEngine *e, StatsTable *merged) {
+    if (num_percentis > 0) {
+        printf("Percentis nao sao suportados pelo motor denso, usando hash\n");
+        return -1;
+    }
+    int num_threads = e->num_threads;
+    KeySpace descobertas;
+    KeySpace *keys = &descobertas;
+    key_space_init(&descobertas);
+
+    if (e->ctx[0].args.cols) {
+        keys = (KeySpace *)&e->ctx[0].args.cols->keys;
+    } else {
+        for (int i = 0; i < num_threads; i++) {
+            key_space_reset(&e->ctx[i].chaves);
+            e->ctx[i].args.keys = &e->ctx[i].chaves;
+        }
+        run_workers(e, key_worker);
+
+        for (int i = 0; i < num_threads; i++) {
+            const KeySpace *locais = &e->ctx[i].chaves;
+            for (int d = 0; d < locais->devices.count; d++) {
+                const char *nome = locais->devices.nomes[d];
+                key_space_add(&descobertas, nome, strlen(nome), locais->periodo_min);
+                key_space_add(&descobertas, nome, strlen(nome), locais->periodo_max);
+            }
+        }
+    }
+
+    if (keys->devices.count == 0) {
+        key_space_free(&descobertas);
+        return 0;
+    }
+
+    size_t num_cells = (size_t)keys->devices.count * (keys->periodo_max - keys->periodo_min + 1);
+    if (num_cells > DENSE_MAX_CELLS) {
+        printf("Espaco de chaves grande demais para o motor denso (%zu celulas), usando hash\n", num_cells);
+        key_space_free(&descobertas);
+        return -1;
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        e->ctx[i].args.keys = keys;
+        e->ctx[i].args.dense = &e->ctx[i].dense;
+    }
+    run_workers(e, dense_worker);
+
+    const DeviceDict *dicts[1] = {&keys->devices};
+    merge_chunks(e, e->ctx[0].args.fila, dicts, 1, merged);
+
+    key_space_free(&descobertas);
+    return 0;
+}
+
+/* Modo NUMA, serial: escreve zeros no trecho das colunas que corresponde ao
+ * trecho da fila da thread, para que as paginas sejam alocadas no no dela
+ * (primeiro toque) antes de read_csv preenche-las. Os trechos sao calculados
+ * sobre a capacidade reservada, que e a estimativa do numero de linhas. */
+static void* touch_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    RecordColumns *cols = (RecordColumns *)args->cols;
+    int num_threads = args->engine->num_threads;
+    long long num_chunks = (cols->cap + CHUNK_RECORDS - 1) / CHUNK_RECORDS;
+    long long inicio = num_chunks * args->id / num_threads * CHUNK_RECORDS;
+    long long fim = num_chunks * (args->id + 1) / num_threads * CHUNK_RECORDS;
+    if (fim > cols->cap) fim = cols->cap;
+    if (inicio >= fim) return NULL;
+
+    for (int j = 0; j < NUM_SENSORS; j++) memset(cols->valores[j] + inicio, 0, (fim - inicio) * sizeof(float));
+    memset(cols->device + inicio, 0, (fim - inicio) * sizeof(int));
+    memset(cols->periodo + inicio, 0, (fim - inicio) * sizeof(int));
+    return NULL;
+}
+
+/* Reserva as colunas pela estimativa de linhas do arquivo e faz o primeiro
+ * toque delas nas threads do pool. */
+static void records_first_touch(SensorEngine *e, const char *filename, RecordColumns *cols) {
+    FILE *file = open_input(filename);
+    if (!file) return;
+    size_t estimativa = estimate_lines(file);
+    close_input(file);
+    if (estimativa == 0) return;
+
+    records_reserve(cols, estimativa < INT_MAX ? (int)estimativa : INT_MAX);
+    for (int i = 0; i < e->num_threads; i++) e->ctx[i].args.cols = cols;
+    run_workers(e, touch_worker);
+}
+
+static void ring_init(Ring *r, size_t cap) {
+    size_t potencia = 1;
+    while (potencia < cap) potencia *= 2;
+    r->slots = malloc(potencia * sizeof(RingSlot));
+    if (!r->slots) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    r->mask = potencia - 1;
+    for (size_t i = 0; i < potencia; i++) atomic_init(&r->slots[i].seq, i);
+    atomic_init(&r->cabeca, 0);
+    atomic_init(&r->cauda, 0);
+}
+
+static void ring_free(Ring *r) {
+    free(r->slots);
+}
+
+/* Poe item na fila; retorna false se ela estiver cheia. */
+static bool ring_push(Ring *r, void *item) {
+    size_t pos = atomic_load_explicit(&r->cabeca, memory_order_relaxed);
+    RingSlot *slot;
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->cabeca, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&r->cabeca, memory_order_relaxed);
+        }
+    }
+    slot->item = item;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+/* Retira o item mais antigo da fila para *item; retorna false se ela estiver
+ * vazia. */
+static bool ring_pop(Ring *r, void **item) {
+    size_t pos = atomic_load_explicit(&r->cauda, memory_order_relaxed);
+    RingSlot *slot;
+    for (;;) {
+        slot = &r->slots[pos & r->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (dif == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->cauda, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (dif < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&r->cauda, memory_order_relaxed);
+        }
+    }
+    *item = slot->item;
+    atomic_store_explicit(&slot->seq, pos + r->mask + 1, memory_order_release);
+    return true;
+}
+
+/* Espera de uma fila vazia ou cheia: cede a CPU algumas vezes e depois dorme
+ * um pouco, para que as threads paradas nao ocupem nucleos enquanto o leitor
+ * espera o disco. */
+static void ring_backoff(int *tentativas) {
+    if (++*tentativas < 64) {
+        sched_yield();
+        return;
+    }
+    struct timespec espera = {0, 50000};
+    nanosleep(&espera, NULL);
+}
+
+static void *ring_pop_wait(Ring *r) {
+    void *item;
+    int tentativas = 0;
+    while (!ring_pop(r, &item)) ring_backoff(&tentativas);
+    return item;
+}
+
+static void ring_push_wait(Ring *r, void *item) {
+    int tentativas = 0;
+    while (!ring_push(r, item)) ring_backoff(&tentativas);
+}
+
+/* Estagio de conversao e agregacao do modo pipeline: cada thread pega o
+ * proximo bloco lido, agrega as linhas na sua tabela, guarda os grupos no
+ * bloco e o devolve ao leitor. Um bloco NULL encerra a thread. */
+static void* pipe_worker(void* arg) {
+    ThreadArgs *args = (ThreadArgs*) arg;
+    Pipeline *pipeline = args->pipeline;
+    StatsTable *stats = args->local_stats;
+    PipeBlock *bloco;
+
+    while ((bloco = ring_pop_wait(&pipeline->trabalho)) != NULL) {
+        long long registros = aggregate_lines(stats, bloco->data, 0, bloco->len, bloco->len);
+        chunk_flush(&bloco->resultado, stats, args->id, pipeline->num_partes, &args->ctx->arena);
+        worker_progress(args->ctx, registros);
+        ring_push_wait(&pipeline->livres, bloco);
+    }
+
+    return NULL;
+}
+
+/* Guarda o resultado de um bloco devolvido pelas threads na posicao dele. */
+static void pipe_collect(PipeBlock *bloco, ChunkResult **resultados, int *cap) {
+    if (bloco->seq < 0) return;
+    while (bloco->seq >= *cap) {
+        *cap = *cap ? *cap * 2 : 64;
+        *resultados = realloc(*resultados, *cap * sizeof(ChunkResult));
+        if (!*resultados) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+    }
+    (*resultados)[bloco->seq] = bloco->resultado;
+    bloco->seq = -1;
+}
+
+/* Modo pipeline: a thread que chamou le o arquivo em blocos de CHUNK_BYTES
+ * com read(), cortados no ultimo fim de linha, enquanto as threads do pool
+ * convertem e agregam os blocos ja lidos; a leitura do disco fica sobreposta
+ * ao processamento. Ha no maximo 2 * num_threads + 2 blocos em uso, entao a
+ * memoria nao depende do tamanho da entrada, que pode vir de um pipe. Os
+ * resultados sao mesclados na ordem dos blocos, como os pedacos dos outros
+ * modos. */
+static int run_pipeline(SensorEngine *e, const char *filename, StatsTable *merged) {
+    int num_threads = e->num_threads;
+    int fd = strcmp(filename, "-") == 0 ? STDIN_FILENO : open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("Erro ao abrir arquivo");
+        return -1;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int max_blocos = 2 * num_threads + 2;
+    Pipeline pipeline;
+    ring_init(&pipeline.trabalho, max_blocos + num_threads);
+    ring_init(&pipeline.livres, max_blocos);
+    pipeline.num_partes = num_threads;
+
+    for (int i = 0; i < num_threads; i++) {
+        StatsTable *t = &e->ctx[i].stats;
+        stats_table_reset(t);
+        e->ctx[i].args.local_stats = t;
+        e->ctx[i].args.pipeline = &pipeline;
+    }
+    start_workers(e, pipe_worker);
+
+    char *sobra = malloc(CHUNK_BYTES);
+    PipeBlock *blocos = calloc(max_blocos, sizeof(PipeBlock));
+    if (!sobra || !blocos) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    size_t num_sobra = 0;
+    int criados = 0;
+    int num_chunks = 0;
+    int cap = 0;
+    ChunkResult *resultados = NULL;
+    bool fim_arquivo = false;
+    bool erro = false;
+
+    while (!fim_arquivo) {
+        PipeBlock *bloco;
+        if (criados < max_blocos) {
+            bloco = &blocos[criados++];
+            bloco->data = malloc(CHUNK_BYTES);
+            bloco->seq = -1;
+            if (!bloco->data) {
+                perror("Erro de alocacao");
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            bloco = ring_pop_wait(&pipeline.livres);
+            pipe_collect(bloco, &resultados, &cap);
+        }
+
+        memcpy(bloco->data, sobra, num_sobra);
+        size_t len = num_sobra;
+        while (len < CHUNK_BYTES) {
+            ssize_t lidos = read(fd, bloco->data + len, CHUNK_BYTES - len);
+            // Em um pipe, um sinal pode interromper a leitura antes de chegar
+            // qualquer byte; basta tentar de novo
+            if (lidos < 0 && errno == EINTR) continue;
+            if (lidos < 0) {
+                perror("Erro ao ler arquivo");
+                erro = true;
+            }
+            if (lidos <= 0) {
+                fim_arquivo = true;
+                break;
+            }
+            len += (size_t)lidos;
+        }
+
+        // O bloco vai ate o ultimo fim de linha; o resto abre o proximo bloco
+        size_t corte = len;
+        if (!fim_arquivo) {
+            char *ultimo = memrchr(bloco->data, '\n', len);
+            if (ultimo) corte = (size_t)(ultimo - bloco->data) + 1;
+        }
+        num_sobra = len - corte;
+        memcpy(sobra, bloco->data + corte, num_sobra);
+
+        bloco->len = corte;
+        if (corte == 0) {
+            ring_push_wait(&pipeline.livres, bloco);
+            continue;
+        }
+        bloco->seq = num_chunks++;
+        ring_push_wait(&pipeline.trabalho, bloco);
+    }
+
+    for (int i = 0; i < num_threads; i++) ring_push_wait(&pipeline.trabalho, NULL);
+    wait_workers(e);
+
+    PipeBlock *bloco;
+    while (ring_pop(&pipeline.livres, (void **)&bloco)) pipe_collect(bloco, &resultados, &cap);
+    for (int i = 0; i < criados; i++) free(blocos[i].data);
+    free(blocos);
+    free(sobra);
+    ring_free(&pipeline.trabalho);
+    ring_free(&pipeline.livres);
+    if (fd != STDIN_FILENO) close(fd);
+
+    ChunkQueue fila = {NULL, num_chunks, num_threads, NULL, 0, resultados};
+    for (int i = 0; i < num_threads; i++) e->ctx[i].args.pipeline = NULL;
+    const DeviceDict *dicts[num_threads];
+    for (int i = 0; i < num_threads; i++) dicts[i] = &e->ctx[i].stats.devices;
+    merge_chunks(e, &fila, dicts, num_threads, merged);
+    free(resultados);
+    return erro ? -1 : 0;
+}
+
+/* Cache colunar. scb_convert le o CSV uma vez e grava as colunas; depois
+ * engine_run mapeia o arquivo e usa as colunas direto do mapeamento, sem
+ * converter texto nem copiar os dados. */
+
+static bool scb_write(FILE *f, const void *dados, size_t bytes, uint64_t *pos) {
+    static const char zeros[CACHE_LINE] = {0};
+    size_t pad = (CACHE_LINE - *pos % CACHE_LINE) % CACHE_LINE;
+    if (fwrite(zeros, 1, pad, f) != pad || fwrite(dados, 1, bytes, f) != bytes) return false;
+    *pos += pad + bytes;
+    return true;
+}
+
+int scb_convert(const char *csv, const char *destino) {
+    MappedFile map;
+    if (map_csv(csv, &map) != 0) return -1;
+
+    RecordColumns cols;
+    records_init(&cols);
+    SensorRef ref;
+    size_t pos = 0;
+    while (pos < map.size) {
+        size_t fim_linha;
+        if (parse_ref_any_month(map.data, pos, map.size, &ref, true, &fim_linha)) {
+            float valores[NUM_SENSORS] = {ref.temperature, ref.humidity, ref.luminosity, ref.noise, ref.eco2, ref.etvoc};
+            records_push(&cols, map.data + ref.device_off, ref.device_len, ref.month, valores);
+        }
+        pos = fim_linha + 1;
+    }
+    unmap_csv(&map);
+
+    ScbHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SCB_MAGIC, sizeof(h.magic));
+    h.versao = SCB_VERSION;
+    h.ordem_bytes = SCB_BYTE_ORDER;
+    h.num_registros = cols.count;
+    h.num_devices = cols.keys.devices.count;
+    h.num_blocos = (cols.count + CHUNK_RECORDS - 1) / CHUNK_RECORDS;
+    h.registros_por_bloco = CHUNK_RECORDS;
+    h.mes_min = cols.keys.periodo_min;
+    h.mes_max = cols.keys.periodo_max;
+
+    ScbBlockMeta *blocos = calloc(h.num_blocos + 1, sizeof(ScbBlockMeta));
+    if (!blocos) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    for (uint32_t b = 0; b < h.num_blocos; b++) {
+        ScbBlockMeta *m = &blocos[b];
+        int inicio = b * CHUNK_RECORDS;
+        int fim = inicio + CHUNK_RECORDS < cols.count ? inicio + CHUNK_RECORDS : cols.count;
+        m->mes_min = INT32_MAX;
+        m->mes_max = INT32_MIN;
+        for (int j = 0; j < NUM_SENSORS; j++) {
+            m->min[j] = INFINITY;
+            m->max[j] = -INFINITY;
+        }
+        for (int i = inicio; i < fim; i++) {
+            if (cols.periodo[i] < m->mes_min) m->mes_min = cols.periodo[i];
+            if (cols.periodo[i] > m->mes_max) m->mes_max = cols.periodo[i];
+            for (int j = 0; j < NUM_SENSORS; j++) {
+                float v = cols.valores[j][i];
+                m->min[j] = v < m->min[j] ? v : m->min[j];
+                m->max[j] = v > m->max[j] ? v : m->max[j];
+            }
+        }
+    }
+
+    // Grava em um arquivo temporario e renomeia no fim, para que um cache
+    // pela metade nunca seja usado
+    char temporario[strlen(destino) + 5];
+    snprintf(temporario, sizeof(temporario), "%s.tmp", destino);
+    FILE *f = fopen(temporario, "wb");
+    if (!f) {
+        perror("Erro ao criar cache colunar");
+        free(blocos);
+        records_free(&cols);
+        return -1;
+    }
+
+    // Dicionario: os nomes em sequencia, cada um terminado em '\0'
+    for (int d = 0; d < cols.keys.devices.count; d++) h.tam_devices += strlen(cols.keys.devices.nomes[d]) + 1;
+    char *nomes = malloc(h.tam_devices + 1);
+    if (!nomes) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    char *fim_nomes = nomes;
+    for (int d = 0; d < cols.keys.devices.count; d++) fim_nomes = stpcpy(fim_nomes, cols.keys.devices.nomes[d]) + 1;
+
+    uint64_t escrito = sizeof(h);
+    bool ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = ok && scb_write(f, nomes, h.tam_devices, &escrito);
+    h.off_devices = escrito - h.tam_devices;
+    free(nomes);
+    ok = ok && scb_write(f, blocos, h.num_blocos * sizeof(ScbBlockMeta), &escrito);
+    h.off_blocos = escrito - h.num_blocos * sizeof(ScbBlockMeta);
+    ok = ok && scb_write(f, cols.device, cols.count * sizeof(int32_t), &escrito);
+    h.off_device = escrito - cols.count * sizeof(int32_t);
+    ok = ok && scb_write(f, cols.periodo, cols.count * sizeof(int32_t), &escrito);
+    h.off_month = escrito - cols.count * sizeof(int32_t);
+    for (int j = 0; ok && j < NUM_SENSORS; j++) {
+        ok = scb_write(f, cols.valores[j], cols.count * sizeof(float), &escrito);
+        h.off_valores[j] = escrito - cols.count * sizeof(float);
+    }
+    ok = ok && fseek(f, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, f) == 1;
+    ok = fclose(f) == 0 && ok;
+    if (!ok || rename(temporario, destino) != 0) {
+        perror("Erro ao gravar cache colunar");
+        remove(temporario);
+        free(blocos);
+        records_free(&cols);
+        return -1;
+    }
+
+    int count = cols.count;
+    free(blocos);
+    records_free(&cols);
+    return count;
+}
+
+static bool scb_section_ok(const MappedFile *map, uint64_t off, uint64_t bytes) {
+    return off <= map->size && bytes <= map->size - off && off % sizeof(int32_t) == 0;
+}
+
+/* Mapeia o cache colunar path e aponta as colunas para ele. Retorna -1, sem
+ * deixar nada mapeado, se o arquivo nao for um cache valido desta versao. */
+static int scb_load(const char *path, MappedFile *map, RecordColumns *cols) {
+    if (map_csv(path, map) != 0) return -1;
+    const ScbHeader *h = (const ScbHeader *)map->data;
+    uint64_t n = map->size >= sizeof(ScbHeader) ? h->num_registros : 0;
+
+    bool ok = map->size >= sizeof(ScbHeader) && memcmp(h->magic, SCB_MAGIC, sizeof(h->magic)) == 0 &&
+              h->versao == SCB_VERSION && h->ordem_bytes == SCB_BYTE_ORDER &&
+              h->registros_por_bloco == CHUNK_RECORDS && n <= INT_MAX &&
+              h->num_blocos == (n + CHUNK_RECORDS - 1) / CHUNK_RECORDS &&
+              scb_section_ok(map, h->off_devices, h->tam_devices) &&
+              scb_section_ok(map, h->off_blocos, (uint64_t)h->num_blocos * sizeof(ScbBlockMeta)) &&
+              scb_section_ok(map, h->off_device, n * sizeof(int32_t)) &&
+              scb_section_ok(map, h->off_month, n * sizeof(int32_t));
+    for (int j = 0; ok && j < NUM_SENSORS; j++) ok = scb_section_ok(map, h->off_valores[j], n * sizeof(float));
+    ok = ok && (h->num_devices == 0 || (h->tam_devices > 0 && map->data[h->off_devices + h->tam_devices - 1] == '\0'));
+
+    // O dicionario volta a ser um DeviceDict com os mesmos ids do arquivo
+    const char *nome = ok ? map->data + h->off_devices : NULL;
+    for (uint32_t d = 0; ok && d < h->num_devices; d++) {
+        size_t len = strlen(nome);
+        ok = nome + len < map->data + h->off_devices + h->tam_devices &&
+             device_dict_intern(&cols->keys.devices, nome, len) == (int)d;
+        nome += len + 1;
+    }
+
+    // Ids e meses viram indices na agregacao: cada bloco tem de caber na faixa
+    // do cabecalho e cada registro na faixa do seu bloco, com um device valido
+    ok = ok && (n == 0 || (h->mes_min >= 0 && h->mes_min <= h->mes_max));
+    const ScbBlockMeta *blocos = ok ? (const ScbBlockMeta *)(map->data + h->off_blocos) : NULL;
+    const int32_t *devices = ok ? (const int32_t *)(map->data + h->off_device) : NULL;
+    const int32_t *meses = ok ? (const int32_t *)(map->data + h->off_month) : NULL;
+    for (uint32_t b = 0; ok && b < h->num_blocos; b++) {
+        const ScbBlockMeta *m = &blocos[b];
+        ok = m->mes_min >= h->mes_min && m->mes_min <= m->mes_max && m->mes_max <= h->mes_max;
+        uint64_t fim = (uint64_t)(b + 1) * CHUNK_RECORDS < n ? (uint64_t)(b + 1) * CHUNK_RECORDS : n;
+        for (uint64_t i = (uint64_t)b * CHUNK_RECORDS; ok && i < fim; i++) {
+            ok = devices[i] >= 0 && (uint32_t)devices[i] < h->num_devices && meses[i] >= m->mes_min &&
+                 meses[i] <= m->mes_max;
+        }
+    }
+    if (!ok) {
+        // Descarta o que ja entrou no dicionario para o CSV comecar do zero
+        records_free(cols);
+        records_init(cols);
+        unmap_csv(map);
+        return -1;
+    }
+
+    cols->emprestadas = true;
+    cols->count = (int)n;
+    cols->cap = (int)n;
+    cols->device = (int *)(map->data + h->off_device);
+    cols->periodo = (int *)(map->data + h->off_month);
+    for (int j = 0; j < NUM_SENSORS; j++) cols->valores[j] = (float *)(map->data + h->off_valores[j]);
+    cols->blocos = (const ScbBlockMeta *)(map->data + h->off_blocos);
+
+    // So os meses do filtro entram na agregacao
+    cols->keys.periodo_min = h->mes_min > filtro_mes_de ? h->mes_min : filtro_mes_de;
+    cols->keys.periodo_max = h->mes_max < filtro_mes_ate ? h->mes_max : filtro_mes_ate;
+    if (cols->keys.periodo_min > cols->keys.periodo_max) cols->count = 0;
+    madvise((void *)map->data, map->size, MADV_WILLNEED);
+    return 0;
+}
+
+char *scb_cache_path(const char *filename) {
+    char *path = malloc(strlen(filename) + 5);
+    if (!path) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(path, "%s.scb", filename);
+    return path;
+}
+
+/* Caminho do cache colunar a usar para filename, ou NULL se nao houver: o
+ * proprio arquivo, se ja for um cache, ou filename.scb, se existir e nao for
+ * mais antigo que o CSV. */
+static char *scb_find(const char *filename) {
+    if (strcmp(filename, "-") == 0) return NULL;
+
+    char magic[sizeof(SCB_MAGIC) - 1];
+    FILE *f = fopen(filename, "rb");
+    if (!f) return NULL;
+    bool e_cache = fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, SCB_MAGIC, sizeof(magic)) == 0;
+    fclose(f);
+    if (e_cache) return strdup(filename);
+
+    char *path = scb_cache_path(filename);
+    struct stat csv, cache;
+    if (stat(filename, &csv) == 0 && stat(path, &cache) == 0 && S_ISREG(cache.st_mode) &&
+        (cache.st_mtim.tv_sec > csv.st_mtim.tv_sec ||
+         (cache.st_mtim.tv_sec == csv.st_mtim.tv_sec && cache.st_mtim.tv_nsec >= csv.st_mtim.tv_nsec))) {
+        return path;
+    }
+    free(path);
+    return NULL;
+}
+
+/* Checkpoint do modo incremental. */
+
+static void checkpoint_hash(const MappedFile *map, size_t offset, CkpHeader *h) {
+    size_t inicio = offset > CKP_JANELA ? offset - CKP_JANELA : 0;
+    h->hash_inicio = string_hash(map->data, offset < CKP_JANELA ? offset : CKP_JANELA);
+    h->hash_fim = string_hash(map->data + inicio, offset - inicio);
+}
+
+int checkpoint_save(const char *path, const char *filename, const StatsTable *stats, size_t offset) {
+    MappedFile map;
+    if (map_csv(filename, &map) != 0) return -1;
+    if (offset > map.size) {
+        unmap_csv(&map);
+        return -1;
+    }
+
+    CkpHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CKP_MAGIC, sizeof(h.magic));
+    h.versao = CKP_VERSION;
+    h.ordem_bytes = SCB_BYTE_ORDER;
+    h.offset = offset;
+    checkpoint_hash(&map, offset, &h);
+    h.tam_grupo = sizeof(SensorStats);
+    h.tam_sketch = stats->sketches ? sizeof(QuantileSketch) : 0;
+    h.mes_de = filtro_mes_de;
+    h.mes_ate = filtro_mes_ate;
+    h.num_devices = stats->devices.count;
+    h.num_grupos = stats->count;
+    h.granularidade = stats->granularidade;
+    unmap_csv(&map);
+
+    for (int d = 0; d < stats->devices.count; d++) h.tam_devices += strlen(stats->devices.nomes[d]) + 1;
+    char *nomes = malloc(h.tam_devices + 1);
+    if (!nomes) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    char *fim_nomes = nomes;
+    for (int d = 0; d < stats->devices.count; d++) fim_nomes = stpcpy(fim_nomes, stats->devices.nomes[d]) + 1;
+
+    // Como no cache colunar, o checkpoint so substitui o anterior quando
+    // esta completo
+    char temporario[strlen(path) + 5];
+    snprintf(temporario, sizeof(temporario), "%s.tmp", path);
+    FILE *f = fopen(temporario, "wb");
+    bool ok = f && fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(nomes, 1, h.tam_devices, f) == h.tam_devices &&
+              fwrite(stats->itens, sizeof(SensorStats), stats->count, f) == (size_t)stats->count &&
+              (!stats->sketches ||
+               fwrite(stats->sketches, sizeof(QuantileSketch), stats->count, f) == (size_t)stats->count);
+    if (f) ok = fclose(f) == 0 && ok;
+    free(nomes);
+    if (!ok || rename(temporario, path) != 0) {
+        perror("Erro ao gravar checkpoint");
+        remove(temporario);
+        return -1;
+    }
+    return 0;
+}
+
+int checkpoint_load(const char *path, const char *filename, StatsTable *stats, size_t *offset) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+
+    CkpHeader h;
+    bool ok = fread(&h, sizeof(h), 1, f) == 1 && memcmp(h.magic, CKP_MAGIC, sizeof(h.magic)) == 0 &&
+              h.versao == CKP_VERSION && h.ordem_bytes == SCB_BYTE_ORDER && h.tam_grupo == sizeof(SensorStats) &&
+              h.num_devices <= INT_MAX && h.num_grupos <= INT_MAX && h.tam_devices < SIZE_MAX;
+    if (!ok) fprintf(stderr, "Checkpoint '%s' invalido\n", path);
+    if (ok && (h.mes_de != filtro_mes_de || h.mes_ate != filtro_mes_ate)) {
+        fprintf(stderr, "Checkpoint '%s' foi gerado com outro intervalo de meses\n", path);
+        ok = false;
+    }
+    if (ok && h.granularidade != (uint32_t)stats->granularidade) {
+        fprintf(stderr, "Checkpoint '%s' foi gerado com outra granularidade\n", path);
+        ok = false;
+    }
+    if (ok && h.tam_sketch != (stats->sketches ? sizeof(QuantileSketch) : 0)) {
+        fprintf(stderr, "Checkpoint '%s' foi gerado %s percentis\n", path, h.tam_sketch ? "com" : "sem");
+        ok = false;
+    }
+
+    char *nomes = NULL;
+    SensorStats *grupos = NULL;
+    QuantileSketch *sketches = NULL;
+    if (ok) {
+        nomes = malloc(h.tam_devices + 1);
+        grupos = malloc((h.num_grupos + 1) * sizeof(SensorStats));
+        if (h.tam_sketch) sketches = malloc((h.num_grupos + 1) * sizeof(QuantileSketch));
+        if (!nomes || !grupos || (h.tam_sketch && !sketches)) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+        ok = fread(nomes, 1, h.tam_devices, f) == h.tam_devices &&
+             fread(grupos, sizeof(SensorStats), h.num_grupos, f) == h.num_grupos &&
+             (!sketches || fread(sketches, sizeof(QuantileSketch), h.num_grupos, f) == h.num_grupos);
+
+        // O dicionario precisa ter exatamente num_devices nomes e os grupos
+        // so podem usar esses ids
+        uint32_t num_nomes = 0;
+        for (uint64_t k = 0; ok && k < h.tam_devices; k++) num_nomes += nomes[k] == '\0';
+        ok = ok && num_nomes == h.num_devices && (h.tam_devices == 0 || nomes[h.tam_devices - 1] == '\0');
+        for (uint32_t g = 0; ok && g < h.num_grupos; g++) {
+            ok = grupos[g].device >= 0 && (uint32_t)grupos[g].device < h.num_devices;
+        }
+        if (!ok) fprintf(stderr, "Checkpoint '%s' invalido\n", path);
+    }
+    fclose(f);
+
+    // O CSV tem que comecar com os mesmos bytes ja agregados
+    MappedFile map;
+    if (ok && map_csv(filename, &map) == 0) {
+        CkpHeader atual = h;
+        ok = h.offset <= map.size;
+        if (ok) checkpoint_hash(&map, h.offset, &atual);
+        ok = ok && atual.hash_inicio == h.hash_inicio && atual.hash_fim == h.hash_fim;
+        unmap_csv(&map);
+        if (!ok) fprintf(stderr, "'%s' mudou desde o checkpoint '%s'\n", filename, path);
+    } else {
+        ok = false;
+    }
+
+    if (ok) {
+        const char *nome = nomes;
+        for (uint32_t d = 0; d < h.num_devices; d++) {
+            size_t len = strlen(nome);
+            device_dict_intern(&stats->devices, nome, len);
+            nome += len + 1;
+        }
+        ok = stats->devices.count == (int)h.num_devices;
+        if (!ok) {
+            fprintf(stderr, "Checkpoint '%s' invalido\n", path);
+            stats_table_reset(stats);
+        }
+        for (uint32_t g = 0; ok && g < h.num_grupos; g++) {
+            bool novo;
+            SensorStats *s = stats_table_get(stats, grupos[g].device, grupos[g].periodo, &novo);
+            *s = grupos[g];
+            if (sketches) *group_sketch(stats, s) = sketches[g];
+        }
+        if (ok) *offset = h.offset;
+    }
+    free(nomes);
+    free(grupos);
+    free(sketches);
+    return ok ? 0 : -1;
+}
+
+/* Limpa os argumentos, os contadores e as arenas das threads e os tempos
+ * antes de uma execucao. */
+static void engine_reset(SensorEngine *e) {
+    e->tempos = (EngineTimings){0};
+    e->em_tarefas = 0;
+    for (int i = 0; i < e->num_threads; i++) {
+        e->ctx[i].ocupado = 0;
+        e->ctx[i].cpu = 0;
+        arena_reset(&e->ctx[i].arena);
+        ThreadArgs *args = &e->ctx[i].args;
+        args->cols = NULL;
+        args->map = NULL;
+        args->fila = NULL;
+        args->local_stats = NULL;
+        args->keys = NULL;
+        args->dense = NULL;
+        args->fusao = NULL;
+        args->pipeline = NULL;
+        atomic_store(&e->ctx[i].pedacos, 0);
+        atomic_store(&e->ctx[i].registros, 0);
+    }
+}
+
+/* Agrega os pedacos de fila (ja com num_chunks e limites) em merged, pelo
+ * motor denso ou pelas tabelas hash das threads. Com usa_colunas os pedacos
+ * sao faixas de cols; sem, faixas de bytes de map. */
+static void run_queue(SensorEngine *e, ChunkQueue *fila, RecordColumns *cols, MappedFile *map, bool usa_colunas,
+                      Engine engine, StatsTable *merged) {
+    int num_threads = e->num_threads;
+    fila->num_partes = num_threads;
+    queue_segment(fila, e->numa ? num_threads : 1);
+    fila->resultados = calloc(fila->num_chunks + 1, sizeof(ChunkResult));
+    if (!fila->resultados) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < num_threads; i++) {
+        e->ctx[i].args.cols = usa_colunas ? cols : NULL;
+        e->ctx[i].args.map = map;
+        e->ctx[i].args.fila = fila;
+    }
+
+    if (engine != ENGINE_DENSE || run_dense(e, merged) != 0) {
+        for (int i = 0; i < num_threads; i++) {
+            StatsTable *t = &e->ctx[i].stats;
+            stats_table_reset(t);
+            e->ctx[i].args.local_stats = t;
+            // No modo serial os ids de device das colunas sao globais; a
+            // tabela local recebe os nomes na mesma ordem para usar os mesmos ids
+            for (int d = 0; d < cols->keys.devices.count; d++) {
+                const char *nome = cols->keys.devices.nomes[d];
+                device_dict_intern(&t->devices, nome, strlen(nome));
+            }
+        }
+
+        run_workers(e, usa_colunas ? thread_worker : mmap_worker);
+
+        const DeviceDict *dicts[num_threads];
+        for (int i = 0; i < num_threads; i++) dicts[i] = &e->ctx[i].stats.devices;
+        merge_chunks(e, fila, dicts, num_threads, merged);
+    }
+
+    free(fila->resultados);
+    free(fila->trechos);
+    free(fila->limites);
+}
+
+/* Fim da preparacao da entrada, que comecou em inicio / inicio_cpu. */
+static void mark_read(SensorEngine *e, double inicio, double inicio_cpu) {
+    e->tempos.leitura = agora() - inicio;
+    e->tempos.leitura_cpu = cpu_agora() - inicio_cpu;
+}
+
+/* O que nao foi leitura nem fusao desde inicio conta como agregacao. */
+static void close_timings(SensorEngine *e, double inicio, double inicio_cpu) {
+    e->tempos.agregacao = agora() - inicio - e->tempos.leitura - e->tempos.fusao;
+    e->tempos.agregacao_cpu = cpu_agora() - inicio_cpu - e->tempos.leitura_cpu - e->tempos.fusao_cpu;
+}
+
+/* Modo stream: le e agrega na thread que chamou. Modo pipeline: ver
+ * run_pipeline. Modos serial e paralelo:
+ * cada thread do pool agrega os pedacos que pegar da fila em sua tabela,
+ * guardando o resultado de cada pedaco, e quando todas terminam os resultados
+ * sao mesclados em merged por merge_chunks, tambem no pool. */
+int engine_run(SensorEngine *e, const char *filename, RunMode mode, Engine engine, StatsTable *merged) {
+    double inicio = agora();
+    double inicio_cpu = cpu_agora();
+    RecordColumns cols;
+    MappedFile map = {NULL, 0};
+    ChunkQueue fila;
+
+    engine_reset(e);
+    // Nos modos stream e pipeline a leitura acontece junto com a agregacao.
+    // O modo stream roda na thread que chamou; os registros contam como da
+    // thread 0
+    if (mode == MODE_STREAM) {
+        long long registros;
+        int r = stream_csv(filename, merged, &registros);
+        atomic_store(&e->ctx[0].registros, registros);
+        close_timings(e, inicio, inicio_cpu);
+        return r;
+    }
+    if (mode == MODE_PIPELINE) {
+        int r = run_pipeline(e, filename, merged);
+        close_timings(e, inicio, inicio_cpu);
+        return r;
+    }
+
+    // Se houver cache colunar para o arquivo, as colunas vem direto dele e
+    // a agregacao e a do modo serial. O cache so tem o mes de cada registro,
+    // entao nao serve para periodos mais finos
+    records_init(&cols);
+    bool colunar = false;
+    char *cache = granularidade_base == GRAN_MONTH ? scb_find(filename) : NULL;
+    if (cache) {
+        colunar = scb_load(cache, &map, &cols) == 0;
+        if (colunar) printf("Usando cache colunar '%s'\n", cache);
+        else fprintf(stderr, "Cache colunar '%s' invalido, lendo o CSV\n", cache);
+        free(cache);
+    }
+    bool usa_colunas = colunar || mode == MODE_SERIAL;
+
+    // A entrada e cortada em pedacos de tamanho fixo, distribuidos sob demanda
+    // por next_chunk. Os cortes nao dependem do numero de threads, entao o
+    // resultado e o mesmo com qualquer numero delas
+    if (usa_colunas) {
+        if (!colunar && e->numa) records_first_touch(e, filename, &cols);
+        if ((!colunar && read_csv(filename, &cols) != 0) || cols.count == 0) {
+            records_free(&cols);
+            unmap_csv(&map);
+            return -1;
+        }
+        int record_count = cols.count;
+        fila.num_chunks = (record_count - 1) / CHUNK_RECORDS + 1;
+        fila.limites = malloc((fila.num_chunks + 1) * sizeof(size_t));
+        if (!fila.limites) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+        for (int c = 0; c <= fila.num_chunks; c++) {
+            size_t limite = (size_t)c * CHUNK_RECORDS;
+            fila.limites[c] = limite < (size_t)record_count ? limite : (size_t)record_count;
+        }
+    } else {
+        if (map_csv(filename, &map) != 0) {
+            records_free(&cols);
+            return -1;
+        }
+        fila.num_chunks = (int)(map.size / CHUNK_BYTES + 1);
+        fila.limites = malloc((fila.num_chunks + 1) * sizeof(size_t));
+        if (!fila.limites) {
+            perror("Erro de alocacao");
+            exit(EXIT_FAILURE);
+        }
+        split_ranges(&map, 0, map.size, fila.num_chunks, fila.limites);
+    }
+    mark_read(e, inicio, inicio_cpu);
+
+    run_queue(e, &fila, &cols, &map, usa_colunas, engine, merged);
+    records_free(&cols);
+    unmap_csv(&map);
+    close_timings(e, inicio, inicio_cpu);
+    return 0;
+}
+
+int engine_run_tail(SensorEngine *e, const char *filename, size_t inicio, Engine engine, StatsTable *merged, size_t *fim) {
+    double t0 = agora();
+    double t0_cpu = cpu_agora();
+    MappedFile map;
+    engine_reset(e);
+    if (map_csv(filename, &map) != 0) return -1;
+    if (inicio > map.size) {
+        fprintf(stderr, "Erro: '%s' tem menos de %zu bytes\n", filename, inicio);
+        unmap_csv(&map);
+        return -1;
+    }
+
+    // So entram linhas completas: uma linha sem '\n' no fim do arquivo pode
+    // estar sendo escrita e fica para a proxima execucao
+    *fim = inicio;
+    const char *nl = inicio < map.size ? memrchr(map.data + inicio, '\n', map.size - inicio) : NULL;
+    if (!nl) {
+        unmap_csv(&map);
+        return 0;
+    }
+    *fim = (size_t)(nl - map.data) + 1;
+
+    RecordColumns cols;
+    ChunkQueue fila;
+    records_init(&cols);
+    fila.num_chunks = (int)((*fim - inicio) / CHUNK_BYTES + 1);
+    fila.limites = malloc((fila.num_chunks + 1) * sizeof(size_t));
+    if (!fila.limites) {
+        perror("Erro de alocacao");
+        exit(EXIT_FAILURE);
+    }
+    split_ranges(&map, inicio, *fim, fila.num_chunks, fila.limites);
+    mark_read(e, t0, t0_cpu);
+
+    run_queue(e, &fila, &cols, &map, false, engine, merged);
+    records_free(&cols);
+    unmap_csv(&map);
+    close_timings(e, t0, t0_cpu);
+    return 0;
+}
+
+/* Contadores de hardware. */
+
+const char *perf_counter_names[NUM_PERF_COUNTERS] = {"ciclos", "falhas_cache", "desvios_errados"};
+
+int perf_counters_start(PerfCounters *p) {
+    static const unsigned long long eventos[NUM_PERF_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int abertos = 0;
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = eventos[i];
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        p->fd[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (p->fd[i] >= 0) abertos++;
+    }
+    if (abertos < NUM_PERF_COUNTERS) {
+        fprintf(stderr, "Aviso: %d de %d contadores de hardware disponiveis (perf_event_open: %s)\n", abertos,
+                NUM_PERF_COUNTERS, strerror(errno));
+    }
+    return abertos;
+}
+
+void perf_counters_read(PerfCounters *p, long long valores[NUM_PERF_COUNTERS]) {
+    for (int i = 0; i < NUM_PERF_COUNTERS; i++) {
+        uint64_t v;
+        valores[i] = -1;
+        if (p->fd[i] < 0) continue;
+        if (read(p->fd[i], &v, sizeof(v)) == sizeof(v)) valores[i] = (long long)v;
+        close(p->fd[i]);
+        p->fd[i] = -1;
+    }
+}
@@ -0,0 +1,318 @@
+#ifndef SENSOR_ENGINE_H
+#define SENSOR_ENGINE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Motor de agregacao dos dados de sensores: le o CSV, agrupa por device e
+ * periodo (ano-mes, ou hora, dia ou semana com granularity_init) e calcula
+ * minimo, maximo, media, variancia e contagem de cada sensor. O motor e
+ * criado uma vez e pode ser executado varias vezes sobre arquivos
+ * diferentes, reaproveitando o pool de threads e as tabelas de cada thread. */
+
+#define SIMD_LANES 8  /* NUM_SENSORS arredondado para um registrador AVX */
+#define SKETCH_BINS 256      /* bins de cada sinal e sensor no sketch de percentis */
+#define MAX_PERCENTILES 16
+
+typedef enum {
+    SENSOR_TEMPERATURE,
+    SENSOR_HUMIDITY,
+    SENSOR_LUMINOSITY,
+    SENSOR_NOISE,
+    SENSOR_ECO2,
+    SENSOR_ETVOC,
+    NUM_SENSORS
+} SensorId;
+
+extern const char *sensor_names[NUM_SENSORS];
+
+/* Granularidades dos periodos, da mais fina para a mais grossa. */
+typedef enum {
+    GRAN_HOUR,
+    GRAN_DAY,
+    GRAN_WEEK,
+    GRAN_MONTH,
+    NUM_GRANULARITIES
+} Granularity;
+
+extern const char *granularity_names[NUM_GRANULARITIES];
+
+/* Minimo, maximo, media e m2 (soma dos quadrados dos desvios da media, de
+ * Welford) dos seis sensores, um por posicao na ordem de SensorId. A media e
+ * m2 sao double, para nao perder precisao em grupos com milhoes de linhas; a
+ * variancia e m2 / count. Os vetores tem SIMD_LANES posicoes para que os
+ * kernels atualizem todos os sensores com operacoes vetoriais; as posicoes
+ * extras ficam em zero e nunca sao impressas. */
+typedef struct {
+    float min[SIMD_LANES];
+    float max[SIMD_LANES];
+    double mean[SIMD_LANES];
+    double m2[SIMD_LANES];
+} SensorAcc;
+
+/* Grupo (device, periodo) com chaves inteiras: device e o id no DeviceDict
+ * da tabela e periodo e um inteiro na granularidade da tabela: ano * 12 +
+ * (mes - 1) por mes e, contando de 0000-03-01, dias por dia, horas por hora e
+ * semanas (de segunda a domingo) por semana. count e comum aos seis sensores
+ * porque toda linha valida traz os seis valores. Os nomes so voltam a ser
+ * texto em salvar_csv, que gera uma linha por sensor. */
+typedef struct {
+    SensorAcc acc;
+    int device;
+    int periodo;
+    int count;
+} SensorStats;
+
+/* Lados do sketch: valores negativos e positivos, cada um pelo valor
+ * absoluto. */
+enum { SKETCH_NEG, SKETCH_POS };
+
+/* Sketch de percentis de um grupo (DDSketch, ver percentiles_init): para
+ * cada sinal e sensor, as contagens dos SKETCH_BINS bins que terminam no bin
+ * de indice topo, mais a contagem de zeros. Sao 2 * NUM_SENSORS *
+ * SKETCH_BINS contadores de 32 bits, cerca de 12 KB por grupo, qualquer que
+ * seja o numero de linhas. */
+typedef struct {
+    int32_t topo[2][NUM_SENSORS];
+    uint32_t zeros[NUM_SENSORS];
+    uint32_t bins[2][NUM_SENSORS][SKETCH_BINS];
+} QuantileSketch;
+
+/* Arena de memoria por incremento de ponteiro (ver arena_alloc). */
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock *primeiro;
+    ArenaBlock *atual;
+} Arena;
+
+/* Dicionario de devices: cada nome distinto recebe um id sequencial e e
+ * guardado uma unica vez, na arena do dicionario, que e descartada de uma vez
+ * quando o dicionario e esvaziado. Usa o mesmo esquema de indice da
+ * StatsTable. */
+typedef struct {
+    char **nomes;
+    unsigned *hashes;
+    int count;
+    int cap;
+    int *indice;
+    int indice_cap;
+    Arena arena;
+} DeviceDict;
+
+/* Tabela de grupos: os grupos ficam em itens, na ordem em que aparecem, e
+ * indice e um hash com enderecamento aberto (sondagem linear) sobre
+ * (device, periodo). Cada item guarda os seis sensores do par, entao uma unica
+ * busca por linha basta. Quando itens enche, os vetores dobram de tamanho,
+ * entao nao ha limite fixo de grupos. Com percentis, sketches[i] e o sketch
+ * de itens[i]; sem, sketches e NULL. */
+typedef struct {
+    DeviceDict devices;
+    SensorStats *itens;
+    QuantileSketch *sketches;
+    int count;
+    int cap;
+    int *indice;
+    int indice_cap;
+    Granularity granularidade;
+} StatsTable;
+
+typedef enum {
+    MODE_PARALLEL,
+    MODE_SERIAL,
+    MODE_STREAM,
+    MODE_PIPELINE
+} RunMode;
+
+typedef enum {
+    ENGINE_HASH,
+    ENGINE_DENSE
+} Engine;
+
+typedef enum {
+    SIMD_AUTO,
+    SIMD_SCALAR,
+    SIMD_SSE,
+    SIMD_AVX2
+} SimdLevel;
+
+extern const char *simd_names[];
+
+typedef struct SensorEngine SensorEngine;
+
+/* Escolhe os kernels de min/max/media. Se nao for chamada, engine_create usa
+ * SIMD_AUTO. Retorna o nivel usado. */
+SimdLevel simd_init(SimdLevel pedido);
+
+/* Converte o "AAAA-MM" do inicio de uma data em ano * 12 + (mes - 1).
+ * Retorna -1 se a data nao comecar nesse formato. */
+int parse_month(const char *date, size_t len);
+
+/* date_filter_init, percentiles_init e granularity_init configuram todos os
+ * motores e tabelas do processo. Devem ser chamadas antes do primeiro
+ * engine_create e do primeiro stats_table_init; depois disso nao mudam nada,
+ * avisam em stderr e retornam -1. */
+
+/* Restringe a agregacao aos meses de mes_de a mes_ate (inclusive, no formato
+ * de parse_month; INT_MAX para nao ter limite superior). Se nao for chamada,
+ * o intervalo e de 2024-03 em diante. Retorna 0, ou -1 se chamada tarde. */
+int date_filter_init(int mes_de, int mes_ate);
+
+/* Liga os percentis aproximados de cada grupo e sensor, dados como "50,95,99.9"
+ * (de 0 a 100, no maximo MAX_PERCENTILES); salvar_csv ganha uma coluna por
+ * percentil. Zero sai exato; um percentil v erra no maximo |v|/64 (~1,6%)
+ * ou M/240, o que for maior, sendo M o maior valor absoluto do mesmo sinal
+ * no grupo e sensor (valores ate 2^(SKETCH_BINS/32) = 256 vezes menores que M
+ * tem bin proprio). Retorna o numero de percentis ou -1 se a lista for
+ * invalida ou a chamada vier tarde. */
+int percentiles_init(const char *lista);
+
+/* Operacoes sobre um sketch: comeca vazio, recebe uma linha de valores (NaN
+ * e ignorado), soma outro sketch e devolve o percentil q (de 0 a 1) do
+ * sensor j, ou NaN se o sensor nao tiver valores. */
+void sketch_init(QuantileSketch *s);
+void sketch_add_row(QuantileSketch *s, const float v[SIMD_LANES]);
+void sketch_merge(QuantileSketch *a, const QuantileSketch *b);
+float sketch_quantile(const QuantileSketch *s, int j, double q);
+
+/* Escolhe as granularidades dos periodos a partir de uma lista como
+ * "hour,day,month" e as poe em niveis, da mais fina para a mais grossa. A
+ * agregacao e feita uma vez so, na granularidade base (a mais fina pedida, ou
+ * dia quando semana e mes sao pedidos sem nada mais fino, ja que as semanas
+ * atravessam os meses); as outras saem de stats_table_rollup. Sem esta
+ * chamada, a granularidade e mes, como antes. Fora do mes, o cache colunar
+ * (que so tem o mes) nao e usado e as linhas sem dia ou hora validos sao
+ * descartadas. Retorna o numero de granularidades ou -1 se a lista for
+ * invalida ou a chamada vier tarde. */
+int granularity_init(const char *lista, Granularity niveis[NUM_GRANULARITIES]);
+
+/* stats_table_init cria a tabela na granularidade base. */
+void stats_table_init(StatsTable *t);
+void stats_table_free(StatsTable *t);
+
+/* Agrupa os grupos de origem em destino (inicializada com stats_table_init e
+ * vazia) na granularidade nivel, que deve ser a de origem ou uma das que se
+ * obtem dela (a base de granularity_init da todas as pedidas). Mescla media,
+ * variancia e sketches como a fusao dos pedacos, sem reler a entrada. */
+void stats_table_rollup(const StatsTable *origem, Granularity nivel, StatsTable *destino);
+
+/* Configuracao do pool. Com cpus (num_cpus posicoes), a thread i e fixada na
+ * CPU cpus[i % num_cpus]; com cpus NULL as threads nao sao fixadas. Com numa,
+ * cada thread comeca pelos pedacos de um trecho contiguo da entrada, e no
+ * modo serial esse trecho das colunas e tocado primeiro por ela, para ficar
+ * na memoria do seu no. */
+typedef struct {
+    int num_threads;
+    const int *cpus;
+    int num_cpus;
+    bool numa;
+} EngineConfig;
+
+/* Cria o motor com num_threads threads, que ficam esperando trabalho ate
+ * engine_destroy. */
+SensorEngine *engine_create(int num_threads);
+SensorEngine *engine_create_config(const EngineConfig *cfg);
+
+/* Agrega filename (ou a entrada padrao, com "-") em merged, que deve ter sido
+ * inicializada com stats_table_init. Retorna -1 se a entrada nao puder ser
+ * lida. */
+int engine_run(SensorEngine *e, const char *filename, RunMode mode, Engine engine, StatsTable *merged);
+
+/* Como engine_run no modo parallel, mas so agrega as linhas completas
+ * (terminadas em '\n') a partir do byte inicio do arquivo regular filename,
+ * que deve ser o inicio de uma linha. Os grupos novos entram em merged depois
+ * dos que ela ja tiver, e em *fim fica a posicao logo apos a ultima linha
+ * agregada. Retorna -1 se o arquivo nao puder ser lido. */
+int engine_run_tail(SensorEngine *e, const char *filename, size_t inicio, Engine engine, StatsTable *merged, size_t *fim);
+
+/* Pedacos e registros ja agregados pelas threads na execucao atual (ou na
+ * ultima) dos modos serial e paralelo. Pode ser chamada de outra thread
+ * enquanto engine_run executa. */
+void engine_progress(SensorEngine *e, long long *pedacos, long long *registros);
+
+/* Tempo, em segundos, de cada fase da ultima execucao. leitura e a preparacao
+ * da entrada (mapear o arquivo, carregar o cache ou, no modo serial, ler todo
+ * o CSV); nos modos parallel, stream e pipeline o parse acontece junto com a
+ * agregacao e entra em agregacao. fusao e a mescla dos resultados dos
+ * pedacos. Os campos _cpu sao o tempo de CPU do processo (todas as threads)
+ * na mesma fase. */
+typedef struct {
+    double leitura;
+    double agregacao;
+    double fusao;
+    double leitura_cpu;
+    double agregacao_cpu;
+    double fusao_cpu;
+} EngineTimings;
+
+void engine_timings(SensorEngine *e, EngineTimings *t);
+
+/* Uma thread do pool na ultima execucao: CPU em que esta fixada (-1 se nao
+ * estiver), pedacos e registros agregados, tempo de parede e de CPU das suas
+ * tarefas e tempo ocioso, parada no fim de cada tarefa esperando as outras
+ * threads terminarem. No modo stream tudo roda na thread que chamou
+ * engine_run e os registros aparecem na thread 0. */
+typedef struct {
+    int cpu_fixada;
+    long long pedacos;
+    long long registros;
+    double ocupado;
+    double cpu;
+    double ocioso;
+} ThreadStats;
+
+int engine_num_threads(SensorEngine *e);
+void engine_thread_stats(SensorEngine *e, int i, ThreadStats *s);
+
+void engine_destroy(SensorEngine *e);
+
+/* Le uma lista de CPUs como "0-3,8" para *cpus. Retorna o numero de CPUs ou
+ * -1 se a lista for invalida. */
+int parse_cpu_list(const char *lista, int **cpus);
+
+/* CPUs que o processo pode usar, agrupadas por no NUMA, para *cpus. Retorna
+ * o numero de CPUs ou -1 em erro. */
+int numa_cpus(int **cpus);
+
+/* Converte o CSV em um cache colunar (.scb) gravado em destino. Quando existe
+ * arquivo.csv.scb mais novo que arquivo.csv, ou quando o proprio arquivo
+ * passado e um cache, engine_run nos modos parallel e serial mapeia o cache
+ * em vez de ler o CSV. Retorna o numero de registros gravados ou -1. */
+int scb_convert(const char *csv, const char *destino);
+
+/* Caminho padrao do cache de filename (filename.scb), alocado com malloc. */
+char *scb_cache_path(const char *filename);
+
+/* Grava em path os grupos de stats, que resumem filename ate o byte offset,
+ * junto com o filtro de meses atual. Retorna -1 em erro. */
+int checkpoint_save(const char *path, const char *filename, const StatsTable *stats, size_t offset);
+
+/* Carrega em stats, que deve estar vazia, o checkpoint path e poe em *offset
+ * o byte de filename onde a agregacao parou. Retorna -1, sem mudar stats, se
+ * o checkpoint nao existir, for invalido, tiver outro filtro de meses, nao
+ * tiver sketches quando stats tem (ou o contrario) ou se filename nao comecar
+ * mais com os bytes ja agregados. */
+int checkpoint_load(const char *path, const char *filename, StatsTable *stats, size_t *offset);
+
+/* Contadores de hardware do processo (ciclos, falhas de cache e desvios mal
+ * previstos), com perf_event_open. Contam as threads criadas depois de
+ * perf_counters_start, mas o valor de uma thread so entra quando ela termina,
+ * entao perf_counters_read deve ser chamada depois de engine_destroy.
+ * perf_counters_start retorna quantos contadores foram abertos; os que nao
+ * puderam ser abertos (sem permissao ou sem suporte) sao lidos como -1. */
+#define NUM_PERF_COUNTERS 3
+
+extern const char *perf_counter_names[NUM_PERF_COUNTERS];
+
+typedef struct {
+    int fd[NUM_PERF_COUNTERS];
+} PerfCounters;
+
+int perf_counters_start(PerfCounters *p);
+void perf_counters_read(PerfCounters *p, long long valores[NUM_PERF_COUNTERS]);
+
+void salvar_csv(const StatsTable *stats, const char *nome_arquivo);
+bool is_regular_file(const char *filename);
+
+#endif
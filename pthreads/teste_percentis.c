@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <unistd.h>
+#include "sensor_engine.h"
+
+/* Teste dos percentis aproximados (QuantileSketch). Confere o limite de erro
+ * documentado em percentiles_init: um percentil v erra no maximo |v|/64 ou
+ * M/240, o que for maior, sendo M o maior valor absoluto do mesmo sinal.
+ *
+ * Primeiro testa o sketch direto (negativos, zeros, valores fora da janela,
+ * fusao). Depois grava um CSV com temperaturas de -10 a 45, agrega com
+ * engine_run nos quatro modos e compara p1, p5, p25, p50, p95 e p99 de cada
+ * grupo e sensor com o valor exato da lista ordenada, o de indice
+ * floor(q * (n - 1)).
+ *
+ * Compilacao: gcc -O2 -o teste_percentis teste_percentis.c sensor_engine.c -lpthread -lm
+ * Uso: ./teste_percentis */
+
+#define DEVICES 4
+#define LINHAS 40000  /* cerca de 4 MB, para ter varios pedacos */
+
+static const double quantis[] = {0.01, 0.05, 0.25, 0.50, 0.95, 0.99};
+#define NUM_QUANTIS (int)(sizeof(quantis) / sizeof(quantis[0]))
+
+static int falhas = 0;
+
+/* splitmix64, como em gerar_dados.c. */
+static uint64_t estado = 1;
+
+static uint64_t proximo(void) {
+    uint64_t z = (estado += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+static unsigned sorteio(unsigned n) {
+    return (unsigned)(proximo() % n);
+}
+
+static int compara_float(const void *a, const void *b) {
+    float x = *(const float *)a, y = *(const float *)b;
+    return (x > y) - (x < y);
+}
+
+/* Confere o percentil q de valores (ordenados, n > 0) contra o sketch. */
+static void confere(const char *nome, const QuantileSketch *s, int j, const float *valores, int n, double q) {
+    float exato = valores[(size_t)(q * (n - 1))];
+    float m_neg = valores[0] < 0 ? -valores[0] : 0;
+    float m_pos = valores[n - 1] > 0 ? valores[n - 1] : 0;
+    double m = exato < 0 ? m_neg : m_pos;
+    double limite = fmax(fabs(exato) / 64, m / 240) * (1 + 1e-6) + 1e-6;
+
+    float obtido = sketch_quantile(s, j, q);
+    if (!(fabs(obtido - exato) <= limite)) {
+        printf("FALHA %s sensor %s p%g: exato %.4f, sketch %.4f, limite %.4f\n", nome, sensor_names[j], q * 100,
+               exato, obtido, limite);
+        falhas++;
+    }
+}
+
+static void teste_sketch(void) {
+    static QuantileSketch s, a, b;
+    static float valores[600];
+    float linha[SIMD_LANES];
+    int n = 0;
+
+    // Vazio
+    sketch_init(&s);
+    if (!isnan(sketch_quantile(&s, 0, 0.5))) {
+        printf("FALHA sketch vazio nao deu NaN\n");
+        falhas++;
+    }
+
+    // Temperaturas de -10 a 45 com zeros, e a mesma coisa em duas metades
+    sketch_init(&a);
+    sketch_init(&b);
+    for (int i = -100; i <= 450; i++) {
+        memset(linha, 0, sizeof(linha));
+        linha[0] = (float)(i / 10.0);
+        linha[1] = NAN;
+        sketch_add_row(&s, linha);
+        sketch_add_row(i % 2 ? &a : &b, linha);
+        valores[n++] = linha[0];
+    }
+    qsort(valores, n, sizeof(float), compara_float);
+    for (int k = 0; k <= 100; k++) confere("sequencia", &s, 0, valores, n, k / 100.0);
+    if (!isnan(sketch_quantile(&s, 1, 0.5))) {
+        printf("FALHA sensor so com NaN nao deu NaN\n");
+        falhas++;
+    }
+    if (sketch_quantile(&s, 0, 100.0 / 550) != 0) {
+        printf("FALHA zero nao saiu exato\n");
+        falhas++;
+    }
+
+    sketch_merge(&a, &b);
+    if (memcmp(&a, &s, sizeof(s)) != 0) {
+        printf("FALHA fusao das metades difere do sketch inteiro\n");
+        falhas++;
+    }
+
+    // Valores mais de 256 vezes menores que o maior caem no bin mais baixo
+    sketch_init(&s);
+    n = 0;
+    for (int i = 0; i < 100; i++) {
+        memset(linha, 0, sizeof(linha));
+        linha[0] = i == 99 ? 1000.0f : i == 98 ? -1000.0f : i % 2 ? 1.0f : -0.001f;
+        sketch_add_row(&s, linha);
+        valores[n++] = linha[0];
+    }
+    qsort(valores, n, sizeof(float), compara_float);
+    for (int k = 0; k <= 100; k++) confere("janela", &s, 0, valores, n, k / 100.0);
+}
+
+static void teste_engine(void) {
+    char path[] = "/tmp/teste_percentisXXXXXX";
+    int fd = mkstemp(path);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!f) {
+        perror("Erro ao criar arquivo temporario");
+        exit(EXIT_FAILURE);
+    }
+
+    // Valores de cada device e sensor, como o motor vai ler do CSV
+    static float valores[DEVICES][NUM_SENSORS][LINHAS];
+    int n[DEVICES] = {0};
+    fprintf(f, "id|device|contagem|data|temperatura|umidade|luminosidade|ruido|eco2|etvoc|latitude|longitude\n");
+    for (int i = 0; i < LINHAS; i++) {
+        unsigned d = sorteio(DEVICES);
+        int v[NUM_SENSORS] = {-100 + (int)sorteio(551), (int)sorteio(1001), (int)sorteio(100001),
+                              300 + (int)sorteio(901), 400 + (int)sorteio(4600), (int)sorteio(1000)};
+        fprintf(f, "%d|sirrosteste_UCS_AMV-%02u|%u|2024-09-%02u %02u:%02u:00.000|%.1f|%.1f|%.1f|%.1f|%d|%d|-29.16|-51.10\n",
+                i, d, sorteio(100), 1 + sorteio(28), sorteio(24), sorteio(60), v[0] / 10.0, v[1] / 10.0, v[2] / 10.0,
+                v[3] / 10.0, v[4], v[5]);
+        for (int j = 0; j < NUM_SENSORS; j++) valores[d][j][n[d]] = j < 4 ? (float)(v[j] / 10.0) : (float)v[j];
+        n[d]++;
+    }
+    if (fclose(f) != 0) {
+        perror("Erro ao gravar arquivo temporario");
+        exit(EXIT_FAILURE);
+    }
+    for (int d = 0; d < DEVICES; d++) {
+        for (int j = 0; j < NUM_SENSORS; j++) qsort(valores[d][j], n[d], sizeof(float), compara_float);
+    }
+
+    static const char *modos[] = {"parallel", "serial", "stream", "pipeline"};
+    static QuantileSketch referencia[DEVICES];
+    SensorEngine *motor = engine_create(4);
+    for (int modo = MODE_PARALLEL; modo <= MODE_PIPELINE; modo++) {
+        StatsTable t;
+        stats_table_init(&t);
+        if (engine_run(motor, path, modo, ENGINE_HASH, &t) != 0 || t.count != DEVICES || !t.sketches) {
+            printf("FALHA modo %s: agregacao deu %d grupos\n", modos[modo], t.count);
+            falhas++;
+            stats_table_free(&t);
+            continue;
+        }
+        for (int g = 0; g < t.count; g++) {
+            int d = atoi(t.devices.nomes[t.itens[g].device] + strlen("sirrosteste_UCS_AMV-"));
+            char nome[64];
+            snprintf(nome, sizeof(nome), "%s AMV-%02d", modos[modo], d);
+            for (int j = 0; j < NUM_SENSORS; j++) {
+                for (int k = 0; k < NUM_QUANTIS; k++) confere(nome, &t.sketches[g], j, valores[d][j], n[d], quantis[k]);
+            }
+            // O sketch nao depende do modo nem da ordem da fusao
+            if (modo == MODE_PARALLEL) referencia[d] = t.sketches[g];
+            else if (memcmp(&referencia[d], &t.sketches[g], sizeof(QuantileSketch)) != 0) {
+                printf("FALHA %s: sketch difere do modo parallel\n", nome);
+                falhas++;
+            }
+        }
+        stats_table_free(&t);
+    }
+    engine_destroy(motor);
+    unlink(path);
+}
+
+int main(void) {
+    simd_init(SIMD_AUTO);
+    if (percentiles_init("1,5,25,50,95,99") <= 0) return EXIT_FAILURE;
+    teste_sketch();
+    teste_engine();
+    if (falhas) {
+        printf("%d falhas\n", falhas);
+        return EXIT_FAILURE;
+    }
+    printf("ok\n");
+    return EXIT_SUCCESS;
+}